@@ -13,16 +13,9 @@ template <>
 struct std::hash<const Lockset> {
 	std::size_t operator()(const Lockset &ls) const {
         size_t seed = 0;
-        int macro = 0;
-		for(std::bitset<64> ele : ls.locks) {
-			for(int i = 0; i < 64; i++) {
-				if (ele.test(i)) {
-					seed ^= macro + i + 0x9e3779b9 + (seed << 6) + (seed >> 2);
-				}
-			}
-			
-			macro++;
-		}
+		ls.for_each([&](uint64_t index) {
+			seed ^= index + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+		});
 		return seed;
     }
 };
@@ -54,12 +47,12 @@ struct std::hash<const TimedLockset> {
 	std::size_t operator()(const TimedLockset &tls) const {
         size_t seed = 0;
         int macro = 0;
-		for(const auto& entry : tls.timestamps) {
-			seed ^= macro + entry.first + 0x9e3779b9 + (seed << 6) + (seed >> 2);
-			seed ^= macro + entry.second + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+		tls.for_each([&](uint64_t mutex, uint64_t timestamp) {
+			seed ^= macro + mutex + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+			seed ^= macro + timestamp + 0x9e3779b9 + (seed << 6) + (seed >> 2);
 			
 			macro++;
-		}
+		});
 		return seed;
     }
 };
@@ -124,7 +117,7 @@ pTimedLockset timedlockset_cache_get(pTimedLockset tls) {
 
 		std::tie(timedlockset_iter, inserted) =
 		timedlocksets_cache.insert(
-			new TimedLockset(tls->timestamps)
+			new TimedLockset(tls)
 		);
 
 		assert(inserted);
@@ -0,0 +1,137 @@
+#ifndef __HAWKSET_CCT_HPP__
+#define __HAWKSET_CCT_HPP__
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include <unordered_map>
+
+/* * *
+ *
+ * Calling context tree
+ *
+ * Each thread keeps its own tree, maintained incrementally by the call/ret
+ * instrumentation, so the calling context of an access is a node pointer.
+ * A node is identified by its parent and an address: the call site for inner
+ * nodes, the accessing instruction for the leaves used as backtraces.
+ *
+ * Thread trees are only read by their own thread while it runs. At analysis
+ * time every node is merged into a global tree (canonical()), so that equal
+ * contexts recorded by different threads compare equal by pointer.
+ *
+ * */
+
+#define CCT_INDEX_THRESHOLD 16
+
+std::atomic_ulong cct_nodes = 0;
+
+struct CCTNode {
+    void * address;
+    CCTNode * parent;
+
+    // Node of the global tree this node was merged into
+    CCTNode * canonical = nullptr;
+
+    CCTNode * last_child = nullptr;
+    std::vector<CCTNode *> children;
+    std::unordered_map<void *, CCTNode *> * index = nullptr;
+
+    CCTNode(void * address = nullptr, CCTNode * parent = nullptr)
+        : address(address), parent(parent) {}
+
+    CCTNode * child(void * child_address) {
+        if(last_child != nullptr && last_child->address == child_address)
+            return last_child;
+
+        CCTNode * node = nullptr;
+
+        if(index != nullptr) {
+            auto it = index->find(child_address);
+            if(it != index->end())
+                node = it->second;
+        } else {
+            for(CCTNode * c : children) {
+                if(c->address == child_address) {
+                    node = c;
+                    break;
+                }
+            }
+        }
+
+        if(node == nullptr) {
+            node = new CCTNode(child_address, this);
+            children.push_back(node);
+            cct_nodes++;
+
+            if(index != nullptr) {
+                (*index)[child_address] = node;
+            } else if(children.size() > CCT_INDEX_THRESHOLD) {
+                index = new std::unordered_map<void *, CCTNode *>();
+                for(CCTNode * c : children)
+                    (*index)[c->address] = c;
+            }
+        }
+
+        last_child = node;
+        return node;
+    }
+
+    bool is_root() const {
+        return parent == nullptr;
+    }
+};
+
+// Per-thread shadow stack, the current node is the context of the next access
+struct CallingContext {
+    CCTNode root;
+    CCTNode * current = &root;
+
+    inline void call(void * call_site) {
+        current = current->child(call_site);
+    }
+
+    inline void ret() {
+        // unmatched returns (longjmp, exceptions, threads entry) stay at the root
+        if(!current->is_root())
+            current = current->parent;
+    }
+
+    // Context of an explicit stack, innermost frame first
+    CCTNode * path(void ** addresses, size_t size) {
+        CCTNode * node = &root;
+        for(size_t i = size; i > 0; i--)
+            node = node->child(addresses[i-1]);
+
+        return node;
+    }
+};
+
+CCTNode cct_global_root;
+
+/*
+    Only called at analysis time, single threaded. Iterative, as the shadow
+    stack follows call chains of any depth: walks up to the first merged
+    ancestor, then merges the path back down.
+*/
+CCTNode * canonical(CCTNode * node) {
+    if(node == nullptr)
+        return nullptr;
+
+    std::vector<CCTNode *> path;
+
+    CCTNode * ancestor = node;
+    while(ancestor->canonical == nullptr && !ancestor->is_root()) {
+        path.push_back(ancestor);
+        ancestor = ancestor->parent;
+    }
+
+    if(ancestor->canonical == nullptr)
+        ancestor->canonical = &cct_global_root;
+
+    for(size_t i = path.size(); i > 0; i--)
+        path[i-1]->canonical = path[i-1]->parent->canonical->child(path[i-1]->address);
+
+    return node->canonical;
+}
+
+#endif
@@ -0,0 +1,159 @@
+#ifndef __HAWKSET_FILTER_HPP__
+#define __HAWKSET_FILTER_HPP__
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "pin.H"
+#include "logger.hpp"
+
+/* * *
+ *
+ * Image and routine filters
+ *
+ * Images and routines are selected by name or glob ('*' and '?'). Exclusion
+ * always wins, and a non empty include list excludes everything it does not
+ * match. Images are matched by full path or file name, routines by symbol
+ * or demangled name.
+ *
+ * The filter is resolved once per image, when it is loaded, into the address
+ * ranges of the excluded code, so the instruction instrumentation only has
+ * to look up the address. Code without symbols is only filtered by image.
+ *
+ * Only called from instrumentation callbacks, which PIN serializes.
+ *
+ * */
+
+bool GlobMatch(const char * pattern, const char * str) {
+    const char * star = nullptr;
+    const char * backtrack = nullptr;
+
+    while(*str) {
+        if(*pattern == '*') {
+            star = pattern++;
+            backtrack = str;
+        } else if(*pattern == '?' || *pattern == *str) {
+            pattern++;
+            str++;
+        } else if(star != nullptr) {
+            pattern = star + 1;
+            str = ++backtrack;
+        } else {
+            return false;
+        }
+    }
+
+    while(*pattern == '*')
+        pattern++;
+
+    return *pattern == '\0';
+}
+
+class CodeFilter {
+    // start -> end of the excluded code
+    std::map<ADDRINT, ADDRINT> excluded;
+
+    size_t n_images = 0;
+    size_t n_routines = 0;
+
+    static bool Matches(const std::vector<std::string> & patterns, const std::string & name) {
+        for(const std::string & pattern : patterns)
+            if(GlobMatch(pattern.c_str(), name.c_str()))
+                return true;
+
+        return false;
+    }
+
+    static bool Selected(const std::vector<std::string> & include, const std::vector<std::string> & exclude,
+                         const std::vector<std::string> & names) {
+        bool included = include.empty();
+
+        for(const std::string & name : names) {
+            if(Matches(exclude, name))
+                return false;
+
+            included = included || Matches(include, name);
+        }
+
+        return included;
+    }
+
+public:
+    std::vector<std::string> include_images;
+    std::vector<std::string> exclude_images;
+    std::vector<std::string> include_routines;
+    std::vector<std::string> exclude_routines;
+
+    bool enabled() const {
+        return !include_images.empty() || !exclude_images.empty() ||
+               !include_routines.empty() || !exclude_routines.empty();
+    }
+
+    void Load(IMG img) {
+        if(!enabled())
+            return;
+
+        const std::string & path = IMG_Name(img);
+        size_t slash = path.rfind('/');
+        std::string file = slash == std::string::npos ? path : path.substr(slash + 1);
+
+        if(!Selected(include_images, exclude_images, {path, file})) {
+            debug("Not instrumenting image %s\n", path.c_str());
+            excluded[IMG_LowAddress(img)] = IMG_HighAddress(img) + 1;
+            n_images++;
+            return;
+        }
+
+        if(include_routines.empty() && exclude_routines.empty())
+            return;
+
+        for(SEC sec = IMG_SecHead(img); SEC_Valid(sec); sec = SEC_Next(sec)) {
+            for(RTN rtn = SEC_RtnHead(sec); RTN_Valid(rtn); rtn = RTN_Next(rtn)) {
+                const std::string & name = RTN_Name(rtn);
+
+                if(Selected(include_routines, exclude_routines,
+                            {name, PIN_UndecorateSymbolName(name, UNDECORATION_NAME_ONLY)}))
+                    continue;
+
+                if(RTN_Size(rtn) == 0)
+                    continue;
+
+                excluded[RTN_Address(rtn)] = RTN_Address(rtn) + RTN_Size(rtn);
+                n_routines++;
+            }
+        }
+    }
+
+    void Unload(IMG img) {
+        if(excluded.empty())
+            return;
+
+        excluded.erase(excluded.lower_bound(IMG_LowAddress(img)),
+                       excluded.upper_bound(IMG_HighAddress(img)));
+    }
+
+    bool Excludes(ADDRINT address) const {
+        if(excluded.empty())
+            return false;
+
+        auto it = excluded.upper_bound(address);
+        if(it == excluded.begin())
+            return false;
+
+        --it;
+        return address < it->second;
+    }
+
+    size_t excluded_images() const {
+        return n_images;
+    }
+
+    size_t excluded_routines() const {
+        return n_routines;
+    }
+};
+
+CodeFilter code_filter;
+
+#endif
@@ -0,0 +1,161 @@
+#ifndef __HAWKSET_GRANULARITY_HPP__
+#define __HAWKSET_GRANULARITY_HPP__
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+#include "shadow.hpp"
+
+/* * *
+ *
+ * Tracking granularity
+ *
+ * The persistency state, the access points and the IRH track granules of
+ * 1 (byte), 8 (word) or 64 (cache line) bytes. Each granule is represented
+ * by its first byte: the masks over a cache line only ever have the first
+ * bit of each granule set, and addresses are those of the granule, so the
+ * analysis itself is the same at every granularity.
+ *
+ * A coarser granularity merges accesses to neighbouring bytes, it may report
+ * races between accesses that do not overlap, never miss one.
+ *
+ * The adaptive granularity tracks bytes, but keeps each line coarse until two
+ * threads, or two lock contexts (timed locksets), touch different bytes of
+ * it. Per line, a shadow word records the first (thread, context) to touch
+ * it and whether it was refined, a second one the bytes that context touched.
+ * Once another context touched exactly those bytes the line is marked shared,
+ * and any later access to other bytes, by the first context too, refines it.
+ * The thread refining a line marks it refining, moves the IRH state of the
+ * line to its bytes, and only then publishes it as refined; until then the
+ * line is coarse for everyone else.
+ * The persistency state is exact anyway (its records are per line), coarse
+ * lines emit a single unpersisted store per store and line, keyed by
+ * LINE_KEY, and the IRH decides once per coarse line. Access points are
+ * recorded with their bytes and expanded at the end, per byte for lines that
+ * were refined.
+ *
+ * */
+
+std::map<std::string, uint64_t> granularities = {
+    {"byte", 0},
+    {"word", 3},
+    {"line", 6},
+    {"adaptive", 0}
+};
+
+// log2 of the granule size
+uint64_t granularity_shift = 0;
+
+bool adaptive_granularity = false;
+
+// Key of a coarse line in the analysis, distinct from the address of its first byte
+#define LINE_KEY(line) ((line) | (1ULL << 63))
+
+#define ADAPTIVE_REFINED (1ULL << 63)
+#define ADAPTIVE_SHARED (1ULL << 62)
+#define ADAPTIVE_REFINING (1ULL << 61)
+#define ADAPTIVE_THREAD_BITS 21
+
+class AdaptiveLines {
+    ShadowMemory owners;
+    ShadowMemory owner_bytes;
+
+    std::atomic<uint64_t> n_refined = 0;
+
+    // Returns true if this call started the refinement of the line
+    bool refine(shadow_word_t & owner, uint64_t word) {
+        while(!(word & (ADAPTIVE_REFINED | ADAPTIVE_REFINING))) {
+            if(owner.compare_exchange_weak(word, word | ADAPTIVE_REFINING, std::memory_order_acq_rel)) {
+                n_refined.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+public:
+    bool refined(uint64_t line) {
+        return owners.get(line >> 6)->load(std::memory_order_acquire) & ADAPTIVE_REFINED;
+    }
+
+    // Called by the thread whose touch started the refinement, once the line state is per byte
+    void publish_refined(uint64_t line) {
+        owners.get(line >> 6)->fetch_or(ADAPTIVE_REFINED, std::memory_order_release);
+    }
+
+    // Returns true if the access started the refinement of the line, to be published by the caller
+    bool touch(uint64_t tid, const void * context, uint64_t line, uint64_t bytes) {
+        shadow_word_t & owner = *owners.get(line >> 6);
+        shadow_word_t & touched = *owner_bytes.get(line >> 6);
+
+        uint64_t hash = ((uint64_t) context * 0x9E3779B97F4A7C15ULL) >> (ADAPTIVE_THREAD_BITS + 3);
+        uint64_t self = (tid + 1) | (hash << ADAPTIVE_THREAD_BITS);
+
+        uint64_t word = owner.load(std::memory_order_acquire);
+
+        while(true) {
+            if(word & (ADAPTIVE_REFINED | ADAPTIVE_REFINING))
+                return false;
+
+            if(word == 0 && !owner.compare_exchange_weak(word, self, std::memory_order_acq_rel))
+                continue;
+
+            if(word == 0 || (word & ~ADAPTIVE_SHARED) == self) {
+                if((touched.load(std::memory_order_relaxed) & bytes) == bytes)
+                    return false;
+
+                // new bytes, which another context may have missed (seq_cst pairs with the marking below)
+                touched.fetch_or(bytes, std::memory_order_seq_cst);
+                word = owner.load(std::memory_order_seq_cst);
+
+                return (word & ADAPTIVE_SHARED) && refine(owner, word);
+            }
+
+            if(!(word & ADAPTIVE_SHARED)) {
+                if(!owner.compare_exchange_weak(word, word | ADAPTIVE_SHARED, std::memory_order_seq_cst))
+                    continue;
+
+                word |= ADAPTIVE_SHARED;
+            }
+
+            // same bytes as the first context, the line is exact as it is
+            if(bytes == touched.load(std::memory_order_seq_cst))
+                return false;
+
+            return refine(owner, word);
+        }
+    }
+
+    uint64_t refined_lines() const {
+        return n_refined.load();
+    }
+
+    size_t memory_size() const {
+        return owners.memory_size() + owner_bytes.memory_size();
+    }
+};
+
+AdaptiveLines adaptive_lines;
+
+inline uint64_t granule(uint64_t address) {
+    return address & ~((1ULL << granularity_shift) - 1);
+}
+
+// Bytes of a cache line -> first byte of each granule they touch
+inline uint64_t granule_bytes(uint64_t bytes) {
+    switch(granularity_shift) {
+    case 0:
+        return bytes;
+    case 3:
+        bytes |= bytes >> 4;
+        bytes |= bytes >> 2;
+        bytes |= bytes >> 1;
+        return bytes & 0x0101010101010101ULL;
+    default:
+        return bytes != 0;
+    }
+}
+
+#endif
@@ -20,6 +20,7 @@
 #include <unordered_set>
 #include <functional>
 #include <utility>
+#include <algorithm>
 
 #include "pin.H"
 #include "trace.hpp"
@@ -29,6 +30,13 @@
 #include "vector_clock.hpp"
 #include "logger.hpp"
 #include "cache.hpp"
+#include "filter.hpp"
+#include "mem_state.hpp"
+#include "roi.hpp"
+#include "granularity.hpp"
+#include "irh.hpp"
+#include "ownership.hpp"
+#include "thread_table.hpp"
 
 
 KNOB<std::string> KnobOutPath(KNOB_MODE_WRITEONCE, "pintool", "out",
@@ -43,18 +51,85 @@ KNOB<int> KnobInitRemoval(KNOB_MODE_WRITEONCE, "pintool", "irh",
 KNOB<int> KnobBacktraceDepth(KNOB_MODE_WRITEONCE, "pintool", "bt-depth",
                               "50", "Depth of backtraces reported");
 
+KNOB<bool> KnobBuffered(KNOB_MODE_WRITEONCE, "pintool", "buffered",
+                              "0", "Record PM accesses in a trace buffer and process them in batches");
+
+KNOB<int> KnobBufferPages(KNOB_MODE_WRITEONCE, "pintool", "buffer-pages",
+                              "64", "Size of the per-thread access buffer (in pages)");
+
+KNOB<int> KnobColdThreshold(KNOB_MODE_WRITEONCE, "pintool", "cold-threshold",
+                              "0", "Executions by a thread without a PM access before an instruction is reduced to a guard, needs -pm-prefilter 0 (0 disables)");
+
+KNOB<int> KnobSampleBurst(KNOB_MODE_WRITEONCE, "pintool", "sample-burst",
+                              "0", "Consecutive PM loads recorded per (thread, instruction) burst (0 disables sampling)");
+
+KNOB<int> KnobSampleDecay(KNOB_MODE_WRITEONCE, "pintool", "sample-decay",
+                              "10", "Factor by which the load sampling rate decreases after each burst");
+
+KNOB<int> KnobSampleMaxPeriod(KNOB_MODE_WRITEONCE, "pintool", "sample-max-period",
+                              "1000", "Lowest load sampling rate, one burst every N");
+
+KNOB<std::string> KnobBacktraceMode(KNOB_MODE_WRITEONCE, "pintool", "bt-mode",
+                              "shadow", "Backtrace strategy (shadow, frame or pin)");
+
 KNOB<std::string> KnobConfigFiles(KNOB_MODE_APPEND, "pintool", "cfg",
                               "", "Configuration file (repeatable)");
 
+KNOB<std::string> KnobIncludeImages(KNOB_MODE_APPEND, "pintool", "include-img",
+                              "", "Only instrument memory accesses of images matching the glob (repeatable)");
+
+KNOB<std::string> KnobExcludeImages(KNOB_MODE_APPEND, "pintool", "exclude-img",
+                              "", "Do not instrument memory accesses of images matching the glob (repeatable)");
+
+KNOB<std::string> KnobIncludeRoutines(KNOB_MODE_APPEND, "pintool", "include-rtn",
+                              "", "Only instrument memory accesses of routines matching the glob (repeatable)");
+
+KNOB<std::string> KnobExcludeRoutines(KNOB_MODE_APPEND, "pintool", "exclude-rtn",
+                              "", "Do not instrument memory accesses of routines matching the glob (repeatable)");
+
+KNOB<std::string> KnobRoiStart(KNOB_MODE_APPEND, "pintool", "roi-start",
+                              "", "Function that starts the region of interest (repeatable)");
+
+KNOB<std::string> KnobRoiStop(KNOB_MODE_APPEND, "pintool", "roi-stop",
+                              "", "Function that stops the region of interest (repeatable)");
+
+KNOB<UINT64> KnobRoiStartICount(KNOB_MODE_WRITEONCE, "pintool", "roi-start-icount",
+                              "0", "Instruction count that starts the region of interest (0 disables)");
+
+KNOB<UINT64> KnobRoiStopICount(KNOB_MODE_WRITEONCE, "pintool", "roi-stop-icount",
+                              "0", "Instruction count that stops the region of interest (0 disables)");
+
+KNOB<bool> KnobLazyInstrumentation(KNOB_MODE_WRITEONCE, "pintool", "lazy",
+                              "1", "Only instrument memory accesses while PM is mapped");
+
 KNOB<bool> KnobCheckUnpersistedWrites(KNOB_MODE_WRITEONCE, "pintool", "unpersisted",
                                         "0", "Use unpersisted writes in the analysis");
 
+KNOB<bool> KnobPMPrefilter(KNOB_MODE_WRITEONCE, "pintool", "pm-prefilter",
+                                        "1", "Guard memory accesses with an inlined PM range check");
+
+KNOB<bool> KnobPrivateLines(KNOB_MODE_WRITEONCE, "pintool", "private-lines",
+                              "1", "Skip the IRH and its records for cache lines accessed by a single thread");
+
+KNOB<std::string> KnobGranularity(KNOB_MODE_WRITEONCE, "pintool", "granularity",
+                              "byte", "Tracking granularity of PM accesses (byte, word, line or adaptive)");
+
 void PrintUsage()
 {
     PIN_ERROR("HawkSet: Automatic, Application-Agnostic, and Efficient Concurrent PM Bug Detection\n" + KNOB_BASE::StringKnobSummary() + "\n");
 }
 
 bool check_unpersisted_stores;
+bool use_private_lines;
+bool use_pm_prefilter;
+bool use_access_buffer;
+uint64_t cold_threshold = 0;
+uint32_t sample_burst = 0;
+uint32_t sample_decay = 10;
+uint32_t sample_max_period = 1000;
+
+// Backtrace arguments of the analysis routines (a CONTEXT only if the backtrace mode needs it)
+IARGLIST backtrace_iargs;
 
 // StoreData from the algorithm described in atc's paper
 struct StoreFenceData {
@@ -63,23 +138,51 @@ struct StoreFenceData {
     backtrace_t write_trace;
     backtrace_t fence_trace;
     uint64_t address;
+    uint64_t bytes; // from address, a record covers the bytes of a line with the same store
     bool persisted;
     bool was_flushed;
 
-    StoreFenceData(pLockset l, uint16_t t, backtrace_t wt, backtrace_t ft, uint64_t a, bool p, bool f)
-        : common_set(l), clock_i(t), write_trace(wt), fence_trace(ft), address(a), persisted(p), was_flushed(f) {}
+    StoreFenceData(pLockset l, uint16_t t, backtrace_t wt, backtrace_t ft, uint64_t a, uint64_t b, bool p, bool f)
+        : common_set(l), clock_i(t), write_trace(wt), fence_trace(ft), address(a), bytes(b), persisted(p), was_flushed(f) {}
+};
+
+// Intersections with the current timed lockset, for one fence or overwrite, the stores share a few locksets
+class IntersectMemo {
+    pTimedLockset current;
+    std::vector<std::pair<pTimedLockset, pLockset>> entries;
+
+public:
+    IntersectMemo(pTimedLockset c) : current(c) {}
+
+    pLockset get(pTimedLockset write) {
+        for(const auto & entry : entries)
+            if(entry.first == write)
+                return entry.second;
+
+        pLockset common_set = intersect_timedlockset(current, write);
+        entries.emplace_back(write, common_set);
+        return common_set;
+    }
 };
 
-struct StoreData {
-    pTimedLockset timed_lockset;
-    backtrace_t backtrace;
+// Access buffer record, filled by the instrumentation in buffered mode
+struct AccessRecord {
+    ADDRINT ip;
+    ADDRINT address;
+    ADDRINT context; // calling context node of the access
+    UINT32 size;
+    UINT32 type; // trace::Instruction
 };
 
+BUFFER_ID access_buffer;
+
+// Tool register holding the current calling context node in buffered mode, so records carry it
+REG context_reg = REG_INVALID();
+
 int64_t  lockset_analysis_time = 0;
 int64_t  output_time = 0;
 int64_t  tool_execution_time = 0;
 
-uint64_t use_init_removal_heuristic_n = 1;
 uint64_t backtrace_depth = 50;
 
 std::map<pthread_t, uint64_t> pthread_id_to_tid;
@@ -94,19 +197,41 @@ int64_t creator_thread_id = -1;
 
 std::map<uint64_t, VectorClock> exit_threads_clock;
 
-std::map<uint64_t, std::bitset<64>> variable_accessed;
-std::map<uint64_t, uint64_t> variable_accessed_map;
-
-PIN_MUTEX variable_accessed_mutex;
-
 PIN_MUTEX thread_creation_mutex;
 PIN_MUTEX thread_exit_mutex;
-PIN_MUTEX backtrace_mutex;
 
 typedef std::set<pLockset> lockset_set_t;
 
-/* cache_line -> address -> state */
-typedef std::unordered_map<uint64_t, std::unordered_map<uint64_t, StoreData>> mem_state_t;
+
+/*
+    Burst sampler of the PM loads of one (thread, instruction), as in LiteRace
+
+    Loads are recorded in bursts of sample_burst executions. After each burst
+    the sampling rate (1 / period) decreases by sample_decay, down to
+    1 / sample_max_period, by skipping the executions in between.
+*/
+struct LoadSampler {
+    uint32_t period = 1;
+    uint32_t burst_left = 0;
+    uint64_t skip_left = 0;
+
+    inline bool sample() {
+        if(skip_left > 0) {
+            skip_left--;
+            return false;
+        }
+
+        if(burst_left == 0)
+            burst_left = sample_burst;
+
+        if(--burst_left == 0) {
+            period = (uint32_t) std::min((uint64_t) period * sample_decay, (uint64_t) sample_max_period);
+            skip_left = (uint64_t) sample_burst * (period - 1);
+        }
+
+        return true;
+    }
+};
 typedef std::map<std::tuple<backtrace_t, backtrace_t, bool>, std::set<backtrace_t>>  reports_t;
 
 struct alignas(64) ThreadData {
@@ -143,10 +268,9 @@ struct alignas(64) ThreadData {
 
     /*
     Cache
-        cache_line -> address -> state
+        cache_line -> dirty and flushed bytes and their state
     */
-    mem_state_t mem_state;
-    mem_state_t flushed_mem_state;
+    CacheState mem_state;
 
 
     //uint64_t pthread_id;
@@ -157,16 +281,29 @@ struct alignas(64) ThreadData {
 
     bool used = false;
 
-    std::vector<void*> stack;
-};
+    // Records of the access buffer up to this point were already processed
+    AccessRecord * buffer_consumed = NULL;
+
+    // Recent mutex -> lock index lookups
+    LockIndexCache lock_indexes;
+
+    // Calling context tree of the thread, current node is the shadow stack
+    CallingContext cct;
 
+    // Executions without PM of the profiled instructions (InsProfile::id)
+    std::vector<uint32_t> ins_executions;
+
+    // ip -> load sampler
+    std::unordered_map<uint64_t, LoadSampler> load_samplers;
+    uint64_t sampled_loads = 0;
+    uint64_t skipped_loads = 0;
+};
 
-#define TLS_MAX_SIZE 1000
 
-ThreadData analysis_data_tls[TLS_MAX_SIZE];
+ThreadTable<ThreadData> analysis_data_tls;
 
 ThreadData * get_thread_data(uint64_t tid) {
-    return analysis_data_tls + tid;
+    return &analysis_data_tls[tid];
 }
 
 uint32_t get_next_id(ThreadData * tdata) {
@@ -180,87 +317,86 @@ uint32_t get_next_id(ThreadData * tdata) {
 
 */
 
-bool IgnoreAccess(uint64_t tid, uint64_t address) {
-    if(!variable_accessed_map.contains(tid))
-        variable_accessed_map[tid] = variable_accessed_map.size();
-
-    tid = variable_accessed_map[tid];
-    assert(tid < 64);
-
-    // first thread accessing the address, ignore access
-    if(!variable_accessed.contains(address)) {
-        variable_accessed[address].set(tid);
-        return true;
-    }
-
-    // thread accessing the address after limit was reached in previous access
-    if(variable_accessed[address].none()) {
-        return false;
+// Bytes of the cache line (in bytes) that are not ignored by the IRH
+inline uint64_t HandleAccessMask(uint64_t tid, uint64_t line, uint64_t bytes) {
+    if(use_init_removal_heuristic_n == 0 || bytes == 0) {
+        return bytes;
     }
 
-    // thread repeats access, does not count as new thread
-    if(variable_accessed[address].test(tid)) {
-        return true;
-    }
-
-    variable_accessed[address].set(tid);
+    return IRHFilterLine(tid, line, bytes);
+}
 
-    // thread access limit reached, clearing the set implies limit reached for future accesses
-    if(variable_accessed[address].count() == use_init_removal_heuristic_n + 1) {
-        variable_accessed[address].reset();
+/*
+    Whether the access is to a line private to the thread, which the IRH would
+    ignore as a whole. The bytes of the first thread of a line that becomes
+    shared are materialized in the IRH before anything else decides on it.
+*/
+inline bool PrivateAccess(uint64_t tid, uint64_t line, uint64_t bytes) {
+    if(!use_private_lines)
         return false;
-    // thread access limit not reached
-    } else {
-        return true;
-    }        
-}
 
-inline bool HandleAccessByte(uint64_t tid, uint64_t address) {
-    if(use_init_removal_heuristic_n == 0) {
+    uint64_t owner, owner_bytes;
+
+    switch(line_owners.access(tid, line, bytes, owner, owner_bytes)) {
+    case LINE_PRIVATE:
         return true;
+    case LINE_BECAME_SHARED:
+        HandleAccessMask(owner, line, owner_bytes);
+        line_owners.shared(line);
+        return false;
+    default:
+        return false;
     }
+}
 
-    bool ret;
-
-    PIN_MutexLock(&variable_accessed_mutex);
+inline bool IsPrivateLine(uint64_t tid, uint64_t line) {
+    return use_private_lines && line_owners.is_private(tid, line);
+}
 
-    ret = !IgnoreAccess(tid, address);
+// Access to a line under the adaptive granularity, which may refine it
+inline void AdaptiveTouch(uint64_t tid, pTimedLockset context, uint64_t line, uint64_t bytes) {
+    if(!adaptive_lines.touch(tid, context, line, bytes))
+        return;
 
-    PIN_MutexUnlock(&variable_accessed_mutex);
+    if(use_init_removal_heuristic_n != 0)
+        IRHRefineLine(line);
 
-    return ret;
+    adaptive_lines.publish_refined(line);
 }
 
-inline std::bitset<64> HandleAccess(uint64_t tid, uint64_t address, uint32_t size) {
-    std::bitset<64> mask;
-
-    assert(size <= 64);
+/*
+    f(address, bytes, store) once per store of the dirty (or flushed) bytes in
+    bytes. Coarse lines of the adaptive granularity are keyed by the line key.
+*/
+template<typename F>
+void ForEachPendingStore(const LineState & line_state, uint64_t bytes, bool flushed, F f) {
+    bool coarse = adaptive_granularity && !adaptive_lines.refined(line_state.line);
 
-    if(use_init_removal_heuristic_n == 0) {
-        if(size == 64)
-            mask.set();
+    line_state.for_each_store(bytes, flushed, [&](uint64_t store_bytes, const StoreData & data) {
+        if(coarse)
+            f(LINE_KEY(line_state.line), 1, data);
         else
-            mask = std::bitset<64>((((uint64_t)1 << size) - 1U));
-
-        return mask;
-    }
-
-    PIN_MutexLock(&variable_accessed_mutex);
-
-    for(size_t i = 0; i < size; i++) {
-        mask.set(i, !IgnoreAccess(tid, address));
-    }
-
-    PIN_MutexUnlock(&variable_accessed_mutex);
-    return mask;
+            f(line_state.line, store_bytes, data);
+    });
 }
 
-void RegisterAccess(uint64_t tid, uint64_t ip, uint64_t address, uint32_t size, const CONTEXT *ctxt) {
-    std::bitset<64> mask;
+/*
+    Access point of the granules of the cache line (first bytes in bytes).
+    The ownership and IRH state is always updated, the access point is only
+    recorded if record is set. Private lines return before any lockset or
+    backtrace work.
+*/
+void RegisterAccess(uint64_t tid, uint64_t ip, uint64_t line, uint64_t bytes, const CONTEXT *ctxt, bool record) {
+    if(PrivateAccess(tid, line, bytes))
+        return;
 
-    mask = HandleAccess(tid, address, size);
+    // the context is only needed while the line is coarse
+    if(adaptive_granularity && !adaptive_lines.refined(line))
+        AdaptiveTouch(tid, get_thread_data(tid)->get_timedlockset(), line, bytes);
 
-    if(mask.none())
+    std::bitset<64> mask = HandleAccessMask(tid, line, bytes);
+
+    if(mask.none() || !record)
         return; 
 
     ThreadData * tdata = get_thread_data(tid);
@@ -269,13 +405,13 @@ COUNT_TIME_GENERIC(backtrace_time,
 #ifdef NO_BACKTRACE
     backtrace_t backtrace = (void *) ip;
 #else
-    backtrace_t backtrace = GetBacktrace(ctxt, backtrace_depth, tdata->stack);
+    backtrace_t backtrace = GetBacktrace(ip, ctxt, backtrace_depth, tdata->cct);
 #endif
 );
     
     uint16_t clock_i = tdata->vector_clocks.size()-1;
 
-    access_key_t key = {address, backtrace, clock_i, mask};
+    access_key_t key = {line, backtrace, clock_i, mask};
     auto & race_likely_loads = tdata->race_likely_loads[key];
 
     Lockset access = std::move(tdata->get_timedlockset()->to_lockset());
@@ -283,13 +419,11 @@ COUNT_TIME_GENERIC(backtrace_time,
     race_likely_loads.insert(lockset_cache_get(&access));
 }
 
-void RegisterUnpersistedStore(uint64_t tid, uint64_t address, StoreData &data, pTimedLockset current_timedlockset, backtrace_t trace, bool was_flushed) {
-    if(!HandleAccessByte(tid, address))
-        return;
-
+// The IRH decision is taken by the caller, for whole cache lines
+void RegisterUnpersistedStore(uint64_t tid, uint64_t address, uint64_t bytes, const StoreData &data, IntersectMemo & memo, backtrace_t trace, bool was_flushed) {
     ThreadData * tdata = get_thread_data(tid);
 
-    pLockset common_set = intersect_timedlockset(current_timedlockset, data.timed_lockset);
+    pLockset common_set = memo.get(data.timed_lockset);
 
     StoreFenceData rlp(
         common_set, 
@@ -297,6 +431,7 @@ void RegisterUnpersistedStore(uint64_t tid, uint64_t address, StoreData &data, p
         data.backtrace, 
         trace,
         address,
+        bytes,
         false,
         was_flushed
     );
@@ -307,44 +442,45 @@ void RegisterUnpersistedStore(uint64_t tid, uint64_t address, StoreData &data, p
 void ProcessFlush(uint64_t tid, uint64_t ip, trace::Instruction flushtype, uint64_t address) {
     ThreadData * tdata = get_thread_data(tid);
 
-    auto& mem_state = tdata->mem_state;
-    auto& flushed_mem_state = tdata->flushed_mem_state;
+    tdata->mem_state.flush(CACHE_LINE(address));
+}
 
-    uint64_t cache_line = CACHE_LINE(address);
+void CheckOverwrite(uint64_t tid, uint64_t cl, uint64_t bytes, CacheState & mem_state, pTimedLockset ls, backtrace_t trace, bool private_line) {
+    LineState * line_state = mem_state.find(cl);
 
-    if(!mem_state.contains(cache_line))
-        return;    
+    if(line_state == nullptr || ((line_state->dirty | line_state->flushed) & bytes) == 0)
+        return;
 
-    for(const auto & entry : mem_state[cache_line]) {
-        flushed_mem_state[cache_line][entry.first] = entry.second;
-    }
+    uint64_t handled = private_line ? 0 : HandleAccessMask(tid, cl, (line_state->dirty | line_state->flushed) & bytes);
 
-    mem_state.erase(cache_line);
-}
+    if(handled == 0) {
+        line_state->clear_dirty(bytes);
+        line_state->clear_flushed(bytes);
+        return;
+    }
 
-void CheckOverwrite(uint64_t tid, uint64_t address, mem_state_t & mem_state, pTimedLockset ls, backtrace_t trace, bool was_flushed) {
+    IntersectMemo memo(ls);
 
-    uint64_t cl = CACHE_LINE(address);
+    ForEachPendingStore(*line_state, handled, false, [&](uint64_t address, uint64_t store_bytes, const StoreData & data) {
+        RegisterUnpersistedStore(tid, address, store_bytes, data, memo, trace, false);
+    });
 
-    auto & cache_line_state = mem_state[cl];
+    ForEachPendingStore(*line_state, handled, true, [&](uint64_t address, uint64_t store_bytes, const StoreData & data) {
+        RegisterUnpersistedStore(tid, address, store_bytes, data, memo, trace, true);
+    });
 
-    if(cache_line_state.contains(address)) {
-        RegisterUnpersistedStore(tid, address, cache_line_state[address], ls, trace, was_flushed);
-        cache_line_state.erase(address);
-    }
+    line_state->clear_dirty(bytes);
+    line_state->clear_flushed(bytes);
 }
 
 void ProcessStore(uint64_t tid, uint64_t ip, uint64_t address, uint32_t size, const CONTEXT *ctxt) {
     ThreadData * tdata = get_thread_data(tid);
 
-    HandleAccess(tid, address, size);
-
-
 COUNT_TIME_GENERIC(backtrace_time, 
 #ifdef NO_BACKTRACE
     backtrace_t backtrace = (void *) ip;
 #else
-    backtrace_t backtrace = GetBacktrace(ctxt, backtrace_depth, tdata->stack);
+    backtrace_t backtrace = GetBacktrace(ip, ctxt, backtrace_depth, tdata->cct);
 #endif
 );
 
@@ -352,21 +488,53 @@ COUNT_TIME_GENERIC(backtrace_time,
     StoreData data = {store_timedlockset, backtrace};
 
     auto & mem_state = tdata->mem_state;
-    auto & flushed_mem_state = tdata->flushed_mem_state;
 
-    for(uint64_t addr = address; addr < address + size; addr++) {
-        if(check_unpersisted_stores) {
-            CheckOverwrite(tid, addr, mem_state, store_timedlockset, backtrace, false);
-            CheckOverwrite(tid, addr, flushed_mem_state, store_timedlockset, backtrace, true);
+    // Processed per cache line, the access can be of any size
+    for(uint64_t cl = CACHE_LINE(address); cl < address + size; cl += 64) {
+        uint64_t begin = std::max(cl, address);
+        uint64_t end = std::min(cl + 64, address + size);
+
+        uint64_t bytes = granule_bytes(line_bytes(begin - cl, end - begin));
+
+        // a private line only keeps its persistency state
+        bool private_line = PrivateAccess(tid, cl, bytes);
+
+        if(!private_line) {
+            if(adaptive_granularity)
+                AdaptiveTouch(tid, store_timedlockset, cl, bytes);
+
+            HandleAccessMask(tid, cl, bytes);
         }
 
-        uint64_t cl = CACHE_LINE(addr);
-        mem_state[cl][addr] = data;
+        if(check_unpersisted_stores)
+            CheckOverwrite(tid, cl, bytes, mem_state, store_timedlockset, backtrace, private_line);
+
+        mem_state.store(cl, bytes, data);
     }
 }
 
 void ProcessRead(uint64_t tid, uint64_t ip, uint64_t address, uint32_t size, const CONTEXT *ctxt) {
-    RegisterAccess(tid, ip, address, size, ctxt);
+    // Loads that are not sampled still count for the IRH, only their access point is dropped
+    bool record = true;
+
+    if(sample_burst) {
+        ThreadData * tdata = get_thread_data(tid);
+
+        record = tdata->load_samplers[ip].sample();
+
+        if(record)
+            tdata->sampled_loads++;
+        else
+            tdata->skipped_loads++;
+    }
+
+    // Access points are registered per cache line, the access can be of any size
+    for(uint64_t cl = CACHE_LINE(address); cl < address + size; cl += 64) {
+        uint64_t begin = std::max(cl, address);
+        uint64_t end = std::min(cl + 64, address + size);
+
+        RegisterAccess(tid, ip, cl, granule_bytes(line_bytes(begin - cl, end - begin)), ctxt, record);
+    }
 }
 
 void ProcessFence(uint64_t tid, uint64_t ip, bool is_rmw, const CONTEXT *ctxt, uint64_t address = 0, uint32_t size = 0) {
@@ -376,40 +544,38 @@ void ProcessFence(uint64_t tid, uint64_t ip, bool is_rmw, const CONTEXT *ctxt, u
         ProcessStore(tid, ip, address, size, ctxt);
     }
     
-    auto& mem_state = tdata->flushed_mem_state;
-    pTimedLockset fence_timedlockset = tdata->get_timedlockset();
+    auto& mem_state = tdata->mem_state;
 
-    if(mem_state.empty())
+    if(!mem_state.has_flushed())
         return;
 
+    IntersectMemo memo(tdata->get_timedlockset());
+
     backtrace_t backtrace = nullptr;
 
-    
-    // Iterate cache lines
-    for(const auto &cache_line : mem_state) {
-        auto &cache_line_state = cache_line.second;
 
-        // Iterate addresses
-        for(const auto &write : cache_line_state) {
-            const StoreData *write_data = &write.second;
-            assert(write_data != NULL);
+    // Iterate flushed cache lines, their flushed bytes are dropped afterwards
+    mem_state.fence([&](const LineState & cache_line_state) {
+        if(IsPrivateLine(tid, cache_line_state.line))
+            return;
 
-            uint64_t address = write.first;
+        uint64_t handled = HandleAccessMask(tid, cache_line_state.line, cache_line_state.flushed);
 
-            if(!HandleAccessByte(tid, address))
-                continue;
+        // One record per store of the line
+        ForEachPendingStore(cache_line_state, handled, true, [&](uint64_t address, uint64_t store_bytes, const StoreData & write) {
+            const StoreData *write_data = &write;
 
             if(backtrace == nullptr) {
         COUNT_TIME_GENERIC(backtrace_time, 
             #ifdef NO_BACKTRACE
                 backtrace = (void *) ip;
             #else
-                backtrace = GetBacktrace(ctxt, backtrace_depth, tdata->stack);
+                backtrace = GetBacktrace(ip, ctxt, backtrace_depth, tdata->cct);
             #endif
         );    
             }
 
-            pLockset common_set = intersect_timedlockset(fence_timedlockset, write_data->timed_lockset);
+            pLockset common_set = memo.get(write_data->timed_lockset);
 
             StoreFenceData rlp(
                 common_set, 
@@ -417,15 +583,14 @@ void ProcessFence(uint64_t tid, uint64_t ip, bool is_rmw, const CONTEXT *ctxt, u
                 write_data->backtrace, 
                 backtrace,
                 address,
+                store_bytes,
                 true,
                 true
             );
 
             tdata->race_likely_stores.push_back(rlp);
-        }
-    }
-
-    mem_state.clear();
+        });
+    });
 }
 
 void ProcessLock(uint64_t tid, uint64_t ip, trace::Instruction locktype, uint64_t mutex, bool special = false) {
@@ -440,10 +605,11 @@ void ProcessLock(uint64_t tid, uint64_t ip, trace::Instruction locktype, uint64_
         case trace::Instruction::LOCK:
         case trace::Instruction::WRLOCK:
         case trace::Instruction::RDLOCK:
+            // the timed lockset is keyed by index, special mutexes already are one
             if(special)
                 tdata->current_timedlockset.lock_special(mutex, get_next_id(tdata));
             else
-                tdata->current_timedlockset.lock(mutex, get_next_id(tdata));
+                tdata->current_timedlockset.lock_special(tdata->lock_indexes.get(mutex), get_next_id(tdata));
             break;
 
 
@@ -452,7 +618,7 @@ void ProcessLock(uint64_t tid, uint64_t ip, trace::Instruction locktype, uint64_
             if(special)
                 tdata->current_timedlockset.unlock_special(mutex);
             else
-                tdata->current_timedlockset.unlock(mutex);
+                tdata->current_timedlockset.unlock_special(tdata->lock_indexes.get(mutex));
             break;
 
 
@@ -509,20 +675,22 @@ void ProcessThreadExit(uint64_t tid) {
     ThreadData * tdata = get_thread_data(tid);
 
     if(check_unpersisted_stores) {
-        auto& mem_state = tdata->mem_state;
-        auto& flushed_mem_state = tdata->flushed_mem_state;
+        IntersectMemo memo(tdata->get_timedlockset());
 
-        for(auto & entry_cl : mem_state) {
-            for(auto & entry_data : entry_cl.second) {
-                RegisterUnpersistedStore(tid, entry_data.first, entry_data.second, tdata->get_timedlockset(), NULL, false);
-            }    
-        }
+        tdata->mem_state.for_each_line([&](const LineState & entry_cl) {
+            if(IsPrivateLine(tid, entry_cl.line))
+                return;
 
-        for(auto & entry_cl : flushed_mem_state) {
-            for(auto & entry_data : entry_cl.second) {
-                RegisterUnpersistedStore(tid, entry_data.first, entry_data.second, tdata->get_timedlockset(), NULL, true);
-            }    
-        }
+            uint64_t handled = HandleAccessMask(tid, entry_cl.line, entry_cl.dirty | entry_cl.flushed);
+
+            ForEachPendingStore(entry_cl, handled, false, [&](uint64_t address, uint64_t store_bytes, const StoreData & data) {
+                RegisterUnpersistedStore(tid, address, store_bytes, data, memo, NULL, false);
+            });
+
+            ForEachPendingStore(entry_cl, handled, true, [&](uint64_t address, uint64_t store_bytes, const StoreData & data) {
+                RegisterUnpersistedStore(tid, address, store_bytes, data, memo, NULL, true);
+            });
+        });
     }
 
     VectorClock clock = tdata->vector_clocks.back();
@@ -634,7 +802,7 @@ uint64_t intersect_exe = 0;
 std::set<backtrace_t> CheckPMRacesPerThread(uint64_t tid, uint64_t write_address, pLockset write_set, VectorClock& write_clock) {
     std::set<backtrace_t> racy_loads;
 
-    for(uint64_t load_tid = 0; load_tid < TLS_MAX_SIZE; load_tid++) {
+    for(uint64_t load_tid = 0; load_tid < analysis_data_tls.size(); load_tid++) {
         ThreadData &thread_data = *get_thread_data(load_tid);
 
         if(!thread_data.used)
@@ -682,7 +850,7 @@ VOID CheckPMRaces(VOID *v) {
     
     lockset_analysis_time -= realtime();
 
-    for(int tid = 0; tid < TLS_MAX_SIZE; tid++) {
+    for(uint64_t tid = 0; tid < analysis_data_tls.size(); tid++) {
         ThreadData &thread_data = *get_thread_data(tid);
 
         if(!thread_data.used)
@@ -693,13 +861,22 @@ VOID CheckPMRaces(VOID *v) {
 
         for(const auto & access_iterator : race_likely_loads) {
             uint64_t address = access_iterator.first.address;
-            backtrace_t trace = access_iterator.first.backtrace;
+            backtrace_t trace = canonical(access_iterator.first.backtrace);
             uint64_t clock_i = access_iterator.first.clock_i;
             std::bitset<64> mask = access_iterator.first.mask;
 
             const lockset_set_t & locksets = access_iterator.second;
             auto key = std::make_pair(trace, clock_i);
 
+            // every access point of the line also matches its coarse stores
+            if(adaptive_granularity) {
+                auto & opt_info = race_likely_loads_opt[LINE_KEY(address)][key];
+                opt_info.insert(locksets.cbegin(), locksets.cend());
+
+                if(!adaptive_lines.refined(address))
+                    continue;
+            }
+
             for(int i = 0; i < 64; i++) {
                 if(mask.test(i)) {
                     auto & opt_info = race_likely_loads_opt[address+i][key];
@@ -714,7 +891,7 @@ VOID CheckPMRaces(VOID *v) {
     reports_t races_per_rlp;
     reports_t unpersisted_races_per_rlp;
 
-    for(int tid = 0; tid < TLS_MAX_SIZE; tid++) {
+    for(uint64_t tid = 0; tid < analysis_data_tls.size(); tid++) {
         ThreadData &thread_data = *get_thread_data(tid);
 
         if(!thread_data.used)
@@ -737,11 +914,15 @@ VOID CheckPMRaces(VOID *v) {
                     std::unordered_set<std::pair<backtrace_t, backtrace_t>>>>> race_likely_stores_opt;
 
         for(const auto & rls : race_likely_stores) {
-            uint64_t write_address = rls.address;
+            auto traces = std::make_pair(canonical(rls.write_trace), canonical(rls.fence_trace));
+
+            for(uint64_t m = rls.bytes; m; m &= m - 1) {
+                uint64_t write_address = rls.address + __builtin_ctzll(m);
 
-            race_likely_stores_opt[std::make_tuple(write_address, rls.persisted, rls.was_flushed)]
-                                  [rls.common_set]
-                                  [rls.clock_i].insert(std::make_pair(rls.write_trace, rls.fence_trace));
+                race_likely_stores_opt[std::make_tuple(write_address, rls.persisted, rls.was_flushed)]
+                                      [rls.common_set]
+                                      [rls.clock_i].insert(traces);
+            }
         }
 
         for(const auto & entry_adr : race_likely_stores_opt) {
@@ -780,10 +961,126 @@ VOID CheckPMRaces(VOID *v) {
 
 */
 
-void TraceWrite(THREADID tid, const CONTEXT *ctxt, ADDRINT ip, ADDRINT address, uint32_t size, trace::Instruction type) {
+/*
+    Per instruction hit profile
+
+    Instructions that keep missing PM are re-instrumented with just the inlined
+    PM envelope check (cold), and promoted back as soon as they hit PM.
+
+    Only done without the pre-filter: with it, every instruction already is
+    guarded by the envelope check, which is all a cold instruction keeps.
+    Every execution reaches the analysis routine then, and is counted in a
+    per-thread counter of the instruction.
+
+    Demotions are batched: the cold instructions are queued and their code
+    is flushed in one call once COLD_BATCH are pending, or at the next
+    system call.
+*/
+
+#define COLD_BATCH 64
+
+struct InsProfile {
+    uint32_t id; // of the instruction counters of the threads
+    std::atomic<bool> pm_hit = false;
+    std::atomic<bool> cold = false;
+
+    InsProfile(uint32_t id) : id(id) {}
+};
+
+// Only accessed at instrumentation time, which PIN serializes
+std::unordered_map<ADDRINT, InsProfile *> ins_profiles;
+std::atomic<uint32_t> n_ins_profiles = 0;
+std::atomic_ulong cold_promotions = 0;
+std::atomic_ulong cold_flushes = 0;
+
+PIN_MUTEX cold_mutex;
+std::vector<ADDRINT> cold_pending;
+std::atomic<size_t> n_cold_pending = 0;
+
+void DemoteColdInstructions() {
+    if(n_cold_pending.load(std::memory_order_relaxed) == 0)
+        return;
+
+    PIN_MutexLock(&cold_mutex);
+
+    if(cold_pending.empty()) {
+        PIN_MutexUnlock(&cold_mutex);
+        return;
+    }
+
+    auto [low, high] = std::minmax_element(cold_pending.begin(), cold_pending.end());
+    ADDRINT start = *low;
+    ADDRINT end = *high;
+
+    cold_pending.clear();
+    n_cold_pending.store(0, std::memory_order_relaxed);
+
+    PIN_MutexUnlock(&cold_mutex);
+
+    cold_flushes++;
+    PIN_RemoveInstrumentationInRange(start, end);
+}
+
+VOID DemoteColdInstructionsSyscall(THREADID tid, CONTEXT *ctxt, SYSCALL_STANDARD std, VOID *v) {
+    DemoteColdInstructions();
+}
+
+InsProfile * GetInsProfile(INS ins) {
+    if(cold_threshold == 0 || use_access_buffer || use_pm_prefilter)
+        return NULL;
+
+    InsProfile *& profile = ins_profiles[INS_Address(ins)];
+
+    if(profile == NULL)
+        profile = new InsProfile(n_ins_profiles++);
+
+    return profile;
+}
+
+inline void ProfileAccess(THREADID tid, InsProfile * profile, ADDRINT ip, bool is_pm) {
+    if(is_pm) {
+        if(!profile->pm_hit.load(std::memory_order_relaxed))
+            profile->pm_hit.store(true, std::memory_order_relaxed);
+        return;
+    }
+
+    std::vector<uint32_t> & executions = get_thread_data(tid)->ins_executions;
+
+    if(profile->id >= executions.size())
+        executions.resize(n_ins_profiles.load(std::memory_order_relaxed));
+
+    if(++executions[profile->id] == cold_threshold && !profile->pm_hit.load(std::memory_order_relaxed)) {
+        profile->cold.store(true, std::memory_order_relaxed);
+
+        PIN_MutexLock(&cold_mutex);
+        cold_pending.push_back(ip);
+        size_t n_pending = cold_pending.size();
+        n_cold_pending.store(n_pending, std::memory_order_relaxed);
+        PIN_MutexUnlock(&cold_mutex);
+
+        if(n_pending >= COLD_BATCH)
+            DemoteColdInstructions();
+    }
+}
+
+inline void PromoteInstruction(InsProfile * profile, ADDRINT ip) {
+    bool cold = true;
+
+    if(profile->cold.compare_exchange_strong(cold, false)) {
+        cold_promotions++;
+        PIN_RemoveInstrumentationInRange(ip, ip);
+    }
+}
+
+void TraceWrite(THREADID tid, const CONTEXT *ctxt, ADDRINT ip, ADDRINT address, uint32_t size, trace::Instruction type, InsProfile * profile) {
 COUNT_TIME_GENERIC(instr_time, {
     COUNT_STORE;
-    if (IsPMAddress(address, size, tid)) {   
+    bool is_pm = IsPMAddress(address, size, tid);
+
+    if(profile != NULL)
+        ProfileAccess(tid, profile, ip, is_pm);
+
+    if (is_pm) {   
         if(type == trace::Instruction::NON_TEMPORAL_STORE) {
             COUNT_PM_NT_STORE;
 
@@ -828,7 +1125,8 @@ COUNT_TIME_GENERIC(instr_time, {
     //COUNT_FENCE;
     COUNT_RMW;
 
-    if (IsPMAddress(address, size, tid)) {
+    // outside the ROI only the fence semantics are kept
+    if (roi_active && IsPMAddress(address, size, tid)) {
         //COUNT_STORE;
         COUNT_RMW_TIME({
             ProcessFence(tid, ip, true, ctxt, address, size);
@@ -841,17 +1139,23 @@ COUNT_TIME_GENERIC(instr_time, {
 })
 }
 
-void TraceRead(THREADID tid, const CONTEXT *ctxt, ADDRINT ip, ADDRINT address, uint32_t size, ADDRINT address2) {
+void TraceRead(THREADID tid, const CONTEXT *ctxt, ADDRINT ip, ADDRINT address, uint32_t size, ADDRINT address2, InsProfile * profile) {
 COUNT_TIME_GENERIC(instr_time, {
     COUNT_LOAD;
-    if(IsPMAddress(address, size, tid)) { 
+    bool is_pm = IsPMAddress(address, size, tid);
+    bool is_pm2 = !is_pm && address2 != 0 && IsPMAddress(address2, size, tid);
+
+    if(profile != NULL)
+        ProfileAccess(tid, profile, ip, is_pm || is_pm2);
+
+    if(is_pm) { 
         COUNT_PM_LOAD;
 
         COUNT_LOAD_TIME({
             ProcessRead(tid, ip, address, size, ctxt);
         })
     }
-    else if(address2 != 0 && IsPMAddress(address2, size, tid)) {
+    else if(is_pm2) {
         COUNT_PM_LOAD;
         COUNT_LOAD_TIME({
             ProcessRead(tid, ip, address2, size, ctxt);
@@ -860,12 +1164,388 @@ COUNT_TIME_GENERIC(instr_time, {
 })
 }
 
-void TraceCall(uint64_t tid, const CONTEXT *ctxt, ADDRINT address) {
-    get_thread_data(tid)->stack.push_back((void*) address);
+/*
+    Range events
+
+    Accesses of arbitrary size or made of several elements (REP string
+    operations, gather/scatter, xsave, ...) are processed as a single event
+    per contiguous PM range, which updates the persistency state per line.
+*/
+
+template<typename F>
+inline void ForEachPMRange(THREADID tid, uint64_t address, uint64_t size, F process) {
+    uint64_t end = address + size;
+    uint64_t pm_start = 0;
+    bool in_pm = false;
+
+    for(uint64_t cl = CACHE_LINE(address); cl < end; cl += 64) {
+        uint64_t begin = std::max(cl, address);
+        bool is_pm = IsPMAddress(begin, std::min(cl + 64, end) - begin, tid);
+
+        if(is_pm && !in_pm)
+            pm_start = begin;
+        else if(!is_pm && in_pm)
+            process(pm_start, begin - pm_start);
+
+        in_pm = is_pm;
+    }
+
+    if(in_pm)
+        process(pm_start, end - pm_start);
+}
+
+void TraceWriteRange(THREADID tid, const CONTEXT *ctxt, ADDRINT ip, ADDRINT address, uint64_t size) {
+COUNT_TIME_GENERIC(instr_time, {
+    COUNT_STORE;
+
+    ForEachPMRange(tid, address, size, [&](uint64_t start, uint64_t length) {
+        COUNT_PM_STORE;
+        COUNT_STORE_TIME({
+            ProcessStore(tid, ip, start, length, ctxt);
+        })
+    });
+})
+}
+
+void TraceReadRange(THREADID tid, const CONTEXT *ctxt, ADDRINT ip, ADDRINT address, uint64_t size) {
+COUNT_TIME_GENERIC(instr_time, {
+    COUNT_LOAD;
+
+    ForEachPMRange(tid, address, size, [&](uint64_t start, uint64_t length) {
+        COUNT_PM_LOAD;
+        COUNT_LOAD_TIME({
+            ProcessRead(tid, ip, start, length, ctxt);
+        })
+    });
+})
+}
+
+ADDRINT PIN_FAST_ANALYSIS_CALL FirstRepIteration(BOOL first) {
+    return first;
+}
+
+// Called on the first iteration only, with the range of every iteration
+void TraceRepString(THREADID tid, const CONTEXT *ctxt, ADDRINT ip, ADDRINT address, uint32_t size, ADDRINT count, ADDRINT flags, BOOL is_write) {
+    if(count == 0)
+        return;
+
+    uint64_t length = count * size;
+
+    // direction flag set, the addresses decrease
+    if(flags & 0x400)
+        address = address + size - length;
+
+    if(is_write)
+        TraceWriteRange(tid, ctxt, ip, address, length);
+    else
+        TraceReadRange(tid, ctxt, ip, address, length);
+}
+
+// Contiguous elements of the same type are merged into a single range
+void TraceMultiAccess(THREADID tid, const CONTEXT *ctxt, ADDRINT ip, PIN_MULTI_MEM_ACCESS_INFO * info) {
+    uint64_t start = 0;
+    uint64_t end = 0;
+    bool is_write = false;
+
+    for(UINT32 i = 0; i <= info->numberOfMemops; i++) {
+        const PIN_MEM_ACCESS_INFO * memop = i < info->numberOfMemops ? &info->memop[i] : NULL;
+
+        if(memop != NULL && !memop->maskOn)
+            continue;
+
+        if(memop != NULL && end != start && memop->memoryAddress == end &&
+           (memop->memopType == PIN_MEMOP_STORE) == is_write) {
+            end += memop->bytesAccessed;
+            continue;
+        }
+
+        if(end != start) {
+            if(is_write)
+                TraceWriteRange(tid, ctxt, ip, start, end - start);
+            else
+                TraceReadRange(tid, ctxt, ip, start, end - start);
+        }
+
+        if(memop != NULL) {
+            start = memop->memoryAddress;
+            end = start + memop->bytesAccessed;
+            is_write = memop->memopType == PIN_MEMOP_STORE;
+        }
+    }
+}
+
+/*
+    PM pre-filter (If routines)
+
+    Kept tiny and branch free so PIN can inline them, the accesses that fall
+    inside the PM envelope are then checked exactly by the Then routine.
+*/
+
+ADDRINT PIN_FAST_ANALYSIS_CALL InPMEnvelope(ADDRINT address) {
+    return EnvelopeContains(pm_envelope.load(std::memory_order_relaxed), address);
+}
+
+ADDRINT PIN_FAST_ANALYSIS_CALL InPMEnvelope2(ADDRINT address, ADDRINT address2) {
+    uint64_t envelope = pm_envelope.load(std::memory_order_relaxed);
+
+    return EnvelopeContains(envelope, address) | EnvelopeContains(envelope, address2);
+}
+
+// RMWs outside of PM, without flushes waiting for a fence, have nothing to analyze
+ADDRINT PIN_FAST_ANALYSIS_CALL RMWNeedsAnalysis(THREADID tid, ADDRINT address) {
+    return EnvelopeContains(pm_envelope.load(std::memory_order_relaxed), address) |
+           analysis_data_tls.lookup(tid).mem_state.has_flushed();
+}
+
+// Then routines of the cold instructions guard
+void ColdWrite(THREADID tid, const CONTEXT *ctxt, ADDRINT ip, ADDRINT address, uint32_t size, trace::Instruction type, InsProfile * profile) {
+    if(!IsPMAddress(address, size, tid))
+        return;
+
+    PromoteInstruction(profile, ip);
+    TraceWrite(tid, ctxt, ip, address, size, type, profile);
+}
+
+void ColdRead(THREADID tid, const CONTEXT *ctxt, ADDRINT ip, ADDRINT address, uint32_t size, ADDRINT address2, InsProfile * profile) {
+    if(!IsPMAddress(address, size, tid) && !(address2 != 0 && IsPMAddress(address2, size, tid)))
+        return;
+
+    PromoteInstruction(profile, ip);
+    TraceRead(tid, ctxt, ip, address, size, address2, profile);
+}
+
+/*
+    Buffered mode
+
+    Accesses inside the PM envelope are appended by PIN to a per-thread trace
+    buffer and processed in batches, either when the buffer fills up or right
+    before any event that changes the state they are processed against
+    (locksets, vector clocks, cache state, PM mappings).
+
+    Calls and returns do not drain the buffer: the call/ret instrumentation
+    keeps the current calling context node in context_reg, which is recorded
+    along with each access and restored while it is processed.
+*/
+
+void ProcessAccessRecords(THREADID tid, const AccessRecord * begin, const AccessRecord * end) {
+    if(begin >= end)
+        return;
+
+    CallingContext & cct = get_thread_data(tid)->cct;
+    CCTNode * current = cct.current;
+
+    for(const AccessRecord * record = begin; record < end; record++) {
+        if(record->context != 0)
+            cct.current = (CCTNode *) record->context;
+
+        if(record->type == trace::Instruction::LOAD)
+            TraceRead(tid, NULL, record->ip, record->address, record->size, 0, NULL);
+        else
+            TraceWrite(tid, NULL, record->ip, record->address, record->size, (trace::Instruction) record->type, NULL);
+    }
+
+    cct.current = current;
+}
+
+VOID * AccessBufferFull(BUFFER_ID id, THREADID tid, const CONTEXT *ctxt, VOID *buf, UINT64 n_elements, VOID *v) {
+    ThreadData * tdata = get_thread_data(tid);
+
+    AccessRecord * records = (AccessRecord *) buf;
+    AccessRecord * begin = records;
+
+    // Part of the buffer may have been processed by a drain
+    if(tdata->buffer_consumed >= records && tdata->buffer_consumed <= records + n_elements)
+        begin = tdata->buffer_consumed;
+
+    ProcessAccessRecords(tid, begin, records + n_elements);
+
+    // The same buffer is handed back to PIN and refilled from the start
+    tdata->buffer_consumed = records;
+    return buf;
+}
+
+VOID DrainAccessBuffer(THREADID tid, const CONTEXT *ctxt) {
+    ThreadData * tdata = get_thread_data(tid);
+
+    if(ctxt == NULL || tdata->buffer_consumed == NULL)
+        return;
+
+    AccessRecord * end = (AccessRecord *) PIN_GetBufferPointer(const_cast<CONTEXT *>(ctxt), access_buffer);
+
+    if(end < tdata->buffer_consumed)
+        return;
+
+    ProcessAccessRecords(tid, tdata->buffer_consumed, end);
+    tdata->buffer_consumed = end;
+}
+
+VOID DrainAccessBufferSyscall(THREADID tid, CONTEXT *ctxt, SYSCALL_STANDARD std, VOID *v) {
+    DrainAccessBuffer(tid, ctxt);
+}
+
+void InsertAccessBufferDrain(INS ins) {
+    INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)DrainAccessBuffer,
+                   IARG_CALL_ORDER, CALL_ORDER_FIRST,
+                   IARG_THREAD_ID,
+                   IARG_CONST_CONTEXT,
+                   IARG_END);
+}
+
+void InsertAccessRecord(INS ins, IARG_TYPE ea, IARG_TYPE size, trace::Instruction type) {
+    if(use_pm_prefilter) {
+        INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)InPMEnvelope,
+                       IARG_FAST_ANALYSIS_CALL,
+                       ea,
+                       IARG_END);
+        INS_InsertFillBufferThen(ins, IPOINT_BEFORE, access_buffer,
+                       IARG_INST_PTR, offsetof(AccessRecord, ip),
+                       ea, offsetof(AccessRecord, address),
+                       IARG_REG_VALUE, context_reg, offsetof(AccessRecord, context),
+                       size, offsetof(AccessRecord, size),
+                       IARG_UINT32, type, offsetof(AccessRecord, type),
+                       IARG_END);
+    } else {
+        INS_InsertFillBuffer(ins, IPOINT_BEFORE, access_buffer,
+                       IARG_INST_PTR, offsetof(AccessRecord, ip),
+                       ea, offsetof(AccessRecord, address),
+                       IARG_REG_VALUE, context_reg, offsetof(AccessRecord, context),
+                       size, offsetof(AccessRecord, size),
+                       IARG_UINT32, type, offsetof(AccessRecord, type),
+                       IARG_END);
+    }
+}
+
+void TraceCall(uint64_t tid, ADDRINT address) {
+    get_thread_data(tid)->cct.call((void*) address);
+}
+
+void TraceRet(uint64_t tid) {
+    get_thread_data(tid)->cct.ret();
+}
+
+// Buffered mode, the new context node is returned into context_reg
+ADDRINT BufferedTraceCall(uint64_t tid, ADDRINT address) {
+    TraceCall(tid, address);
+    return (ADDRINT) get_thread_data(tid)->cct.current;
+}
+
+ADDRINT BufferedTraceRet(uint64_t tid) {
+    TraceRet(tid);
+    return (ADDRINT) get_thread_data(tid)->cct.current;
+}
+
+/*
+    Inserts the analysis routine of a load/store. It is guarded by the inlined
+    PM envelope check when the pre-filter is enabled or the instruction is cold.
+*/
+void InsertWriteCall(INS ins, trace::Instruction type) {
+    InsProfile * profile = GetInsProfile(ins);
+    bool cold = profile != NULL && profile->cold;
+
+    if(use_pm_prefilter || cold) {
+        INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)InPMEnvelope,
+                       IARG_FAST_ANALYSIS_CALL,
+                       IARG_MEMORYWRITE_EA,
+                       IARG_END);
+        INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)(cold ? ColdWrite : TraceWrite),
+                       IARG_THREAD_ID, 
+                       IARG_IARGLIST, backtrace_iargs,
+                       IARG_INST_PTR, 
+                       IARG_MEMORYWRITE_EA, 
+                       IARG_MEMORYWRITE_SIZE, 
+                       IARG_UINT64, type, 
+                       IARG_PTR, profile,
+                       IARG_END);
+    } else {
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)TraceWrite,
+                       IARG_THREAD_ID, 
+                       IARG_IARGLIST, backtrace_iargs,
+                       IARG_INST_PTR, 
+                       IARG_MEMORYWRITE_EA, 
+                       IARG_MEMORYWRITE_SIZE, 
+                       IARG_UINT64, type, 
+                       IARG_PTR, profile,
+                       IARG_END);
+    }
+}
+
+void InsertReadCall(INS ins) {
+    InsProfile * profile = GetInsProfile(ins);
+    bool cold = profile != NULL && profile->cold;
+
+    IARGLIST address2 = IARGLIST_Alloc();
+
+    if(INS_HasMemoryRead2(ins))
+        IARGLIST_AddArguments(address2, IARG_MEMORYREAD2_EA, IARG_END);
+    else
+        IARGLIST_AddArguments(address2, IARG_ADDRINT, 0, IARG_END);
+
+    if(use_pm_prefilter || cold) {
+        if(INS_HasMemoryRead2(ins)) {
+            INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)InPMEnvelope2,
+                           IARG_FAST_ANALYSIS_CALL,
+                           IARG_MEMORYREAD_EA,
+                           IARG_MEMORYREAD2_EA,
+                           IARG_END);
+        } else {
+            INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)InPMEnvelope,
+                           IARG_FAST_ANALYSIS_CALL,
+                           IARG_MEMORYREAD_EA,
+                           IARG_END);
+        }
+        INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)(cold ? ColdRead : TraceRead), 
+                       IARG_THREAD_ID, 
+                       IARG_IARGLIST, backtrace_iargs,
+                       IARG_INST_PTR,
+                       IARG_MEMORYREAD_EA, 
+                       IARG_MEMORYREAD_SIZE,
+                       IARG_IARGLIST, address2,
+                       IARG_PTR, profile,
+                       IARG_END);
+    } else {
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)TraceRead, 
+                       IARG_THREAD_ID, 
+                       IARG_IARGLIST, backtrace_iargs,
+                       IARG_INST_PTR,
+                       IARG_MEMORYREAD_EA, 
+                       IARG_MEMORYREAD_SIZE,
+                       IARG_IARGLIST, address2,
+                       IARG_PTR, profile,
+                       IARG_END);
+    }
+
+    IARGLIST_Free(address2);
+}
+
+// Loads and stores outside of the ROI, before any PM is mapped or in filtered code are not instrumented
+inline bool SkipMemoryAccess(INS ins) {
+    return !roi_active || !PMInstrumentationEnabled() || code_filter.Excludes(INS_Address(ins));
+}
+
+inline bool IsRepStringAccess(INS ins) {
+    return INS_HasRealRep(ins) && IsRepString(INS_Opcode(ins));
+}
+
+inline bool IsMultiAccess(INS ins) {
+    return !INS_IsStandardMemop(ins) && !INS_IsPrefetch(ins) &&
+           (INS_IsMemoryRead(ins) || INS_IsMemoryWrite(ins));
 }
 
-void TraceRet(uint64_t tid, const CONTEXT *ctxt) {
-    get_thread_data(tid)->stack.pop_back();
+void InsertRepStringCall(INS ins, IARG_TYPE ea, IARG_TYPE size, BOOL is_write) {
+    INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)FirstRepIteration,
+                   IARG_FAST_ANALYSIS_CALL,
+                   IARG_FIRST_REP_ITERATION,
+                   IARG_END);
+    INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)TraceRepString,
+                   IARG_THREAD_ID,
+                   IARG_IARGLIST, backtrace_iargs,
+                   IARG_INST_PTR,
+                   ea,
+                   size,
+                   IARG_REG_VALUE, INS_RepCountRegister(ins),
+                   IARG_REG_VALUE, REG_GFLAGS,
+                   IARG_BOOL, is_write,
+                   IARG_END);
 }
 
 VOID TraceInstructions(INS ins, VOID *v) {
@@ -873,41 +1553,85 @@ VOID TraceInstructions(INS ins, VOID *v) {
 COUNT_TIME_GENERIC(injection_time, {
     int opcode = INS_Opcode(ins);
 
+    // Pending accesses are processed before anything that changes their analysis state
+    if(use_access_buffer &&
+        (INS_IsAtomicUpdate(ins) || INS_IsCacheLineFlush(ins) || IsFence(opcode) ||
+         IsRepStringAccess(ins) || IsMultiAccess(ins))) {
+        InsertAccessBufferDrain(ins);
+    }
+
     if(INS_IsCall(ins)) {
-        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)TraceCall, 
-                            IARG_THREAD_ID, 
-                            IARG_CONST_CONTEXT, 
-                            IARG_ADDRINT, INS_Address(ins),
-                            IARG_END);
+        if(BacktraceUsesShadowStack() && use_access_buffer)
+            INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)BufferedTraceCall, 
+                                IARG_THREAD_ID, 
+                                IARG_ADDRINT, INS_Address(ins),
+                                IARG_RETURN_REGS, context_reg,
+                                IARG_END);
+        else if(BacktraceUsesShadowStack())
+            INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)TraceCall, 
+                                IARG_THREAD_ID, 
+                                IARG_ADDRINT, INS_Address(ins),
+                                IARG_END);
     }
     else if(INS_IsRet(ins)) {
-        INS_InsertCall(ins, (INS_IsValidForIpointTakenBranch(ins) ? IPOINT_TAKEN_BRANCH : IPOINT_AFTER), 
-            (AFUNPTR)TraceRet, 
-            IARG_THREAD_ID, 
-            IARG_CONST_CONTEXT, 
-            IARG_END);
+        if(BacktraceUsesShadowStack() && use_access_buffer)
+            INS_InsertCall(ins, (INS_IsValidForIpointTakenBranch(ins) ? IPOINT_TAKEN_BRANCH : IPOINT_AFTER), 
+                (AFUNPTR)BufferedTraceRet, 
+                IARG_THREAD_ID, 
+                IARG_RETURN_REGS, context_reg,
+                IARG_END);
+        else if(BacktraceUsesShadowStack())
+            INS_InsertCall(ins, (INS_IsValidForIpointTakenBranch(ins) ? IPOINT_TAKEN_BRANCH : IPOINT_AFTER), 
+                (AFUNPTR)TraceRet, 
+                IARG_THREAD_ID, 
+                IARG_END);
     }
     else if (INS_IsAtomicUpdate(ins)) {
-        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)TraceRMW,
+        INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)RMWNeedsAnalysis,
+                       IARG_FAST_ANALYSIS_CALL,
+                       IARG_THREAD_ID,
+                       IARG_MEMORYWRITE_EA,
+                       IARG_END);
+        INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)TraceRMW,
                        IARG_THREAD_ID, 
-                       IARG_CONST_CONTEXT, 
+                       IARG_IARGLIST, backtrace_iargs,
                        IARG_INST_PTR, 
                        IARG_MEMORYWRITE_EA, 
                        IARG_MEMORYWRITE_SIZE, 
                        IARG_END);
+    } else if (IsRepStringAccess(ins)) {
+        if(SkipMemoryAccess(ins))
+            return;
+
+        if(INS_IsMemoryWrite(ins))
+            InsertRepStringCall(ins, IARG_MEMORYWRITE_EA, IARG_MEMORYWRITE_SIZE, true);
+        if(INS_IsMemoryRead(ins))
+            InsertRepStringCall(ins, IARG_MEMORYREAD_EA, IARG_MEMORYREAD_SIZE, false);
+    } else if (IsMultiAccess(ins)) {
+        if(SkipMemoryAccess(ins))
+            return;
+
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)TraceMultiAccess,
+                       IARG_THREAD_ID,
+                       IARG_IARGLIST, backtrace_iargs,
+                       IARG_INST_PTR,
+                       IARG_MULTI_MEMORYACCESS_EA,
+                       IARG_END);
     } else if (INS_IsMemoryWrite(ins) && INS_IsStandardMemop(ins)) {
+        if(SkipMemoryAccess(ins))
+            return;
+
         trace::Instruction inst = IsMovnt(opcode)
                                       ? trace::Instruction::NON_TEMPORAL_STORE
                                       : trace::Instruction::STORE;
-        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)TraceWrite,
-                       IARG_THREAD_ID, 
-                       IARG_CONST_CONTEXT, 
-                       IARG_INST_PTR, 
-                       IARG_MEMORYWRITE_EA, 
-                       IARG_MEMORYWRITE_SIZE, 
-                       IARG_UINT64, inst, 
-                       IARG_END);
+        if(use_access_buffer)
+            InsertAccessRecord(ins, IARG_MEMORYWRITE_EA, IARG_MEMORYWRITE_SIZE, inst);
+        else
+            InsertWriteCall(ins, inst);
     } else if (INS_IsCacheLineFlush(ins)) {
+        if(!PMInstrumentationEnabled())
+            return;
+
         INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)TraceFlush,
                        IARG_THREAD_ID, 
                        IARG_INST_PTR, 
@@ -917,27 +1641,20 @@ COUNT_TIME_GENERIC(injection_time, {
     } else if (IsFence(opcode)) {
         INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)TraceFence, 
                        IARG_THREAD_ID, 
-                       IARG_CONST_CONTEXT, 
+                       IARG_IARGLIST, backtrace_iargs,
                        IARG_INST_PTR, 
                        IARG_END);
     } else if(INS_IsMemoryRead(ins) && INS_IsStandardMemop(ins)) {
-        if(INS_HasMemoryRead2(ins)) {
-            INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)TraceRead, 
-                           IARG_THREAD_ID, 
-                           IARG_CONST_CONTEXT, 
-                           IARG_INST_PTR,
-                           IARG_MEMORYREAD_EA, 
-                           IARG_MEMORYREAD_SIZE,
-                           IARG_MEMORYREAD2_EA,
-                           IARG_END);
+        if(SkipMemoryAccess(ins))
+            return;
+
+        if(use_access_buffer) {
+            InsertAccessRecord(ins, IARG_MEMORYREAD_EA, IARG_MEMORYREAD_SIZE, trace::Instruction::LOAD);
+
+            if(INS_HasMemoryRead2(ins))
+                InsertAccessRecord(ins, IARG_MEMORYREAD2_EA, IARG_MEMORYREAD_SIZE, trace::Instruction::LOAD);
         } else {
-            INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)TraceRead, 
-                           IARG_THREAD_ID, 
-                           IARG_CONST_CONTEXT, 
-                           IARG_INST_PTR,
-                           IARG_MEMORYREAD_EA, IARG_MEMORYREAD_SIZE,
-                           IARG_ADDRINT, 0,
-                           IARG_END);
+            InsertReadCall(ins);
         }
     }
 })
@@ -1020,6 +1737,13 @@ COUNT_TIME_GENERIC2(instr_time, lock_time, {
 })
 }
 
+// The index of a destroyed mutex is reused by the next new one
+void DestroyBefore(THREADID tid, ADDRINT retAddr, ADDRINT mutexAddress) {
+COUNT_TIME_GENERIC2(instr_time, lock_time, {
+    Lockset::release_mutex(mutexAddress);
+})
+}
+
 int PthreadCreateReplacement(THREADID tid, 
                              AFUNPTR original, 
                              const CONTEXT * ctxt,
@@ -1028,6 +1752,9 @@ int PthreadCreateReplacement(THREADID tid,
                              ADDRINT start_routine,
                              ADDRINT arg) {
 
+    if(use_access_buffer)
+        DrainAccessBuffer(tid, ctxt);
+
     PIN_MutexLock(&thread_creation_mutex);
 
     creator_thread_id = (int64_t) tid;
@@ -1065,9 +1792,13 @@ VOID TraceThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v) {
         PIN_SemaphoreSet(&thread_creation_semaphore);
     } 
 
-    assert(tid < TLS_MAX_SIZE);
-
     get_thread_data(tid)->used = true;
+    RoiThreadStart(tid);
+
+    if(use_access_buffer) {
+        get_thread_data(tid)->buffer_consumed = (AccessRecord *) PIN_GetBufferPointer(ctxt, access_buffer);
+        PIN_SetContextReg(ctxt, context_reg, (ADDRINT) get_thread_data(tid)->cct.current);
+    }
 
     ProcessThreadInit(tid, creator_thread_id);
 }
@@ -1087,6 +1818,8 @@ int PthreadJoinReplacement(THREADID tid,
                            ADDRINT pid,
                            ADDRINT retval) {
 
+    if(use_access_buffer)
+        DrainAccessBuffer(tid, ctxt);
 
     int result = -1;
 
@@ -1104,6 +1837,9 @@ int PthreadJoinReplacement(THREADID tid,
 }
 
 VOID TraceThreadExit(THREADID tid, const CONTEXT *ctxt, INT32 code, VOID *v) {
+    if(use_access_buffer)
+        DrainAccessBuffer(tid, ctxt);
+
     ProcessThreadExit(tid); 
 
     SUM_GLOBAL_INSTRUCTION_COUNT
@@ -1118,7 +1854,19 @@ COUNT_TIME_GENERIC(image_time, {
 
     debug("Image: %s\n", IMG_Name(img).c_str());
 
+    code_filter.Load(img);
+    InstrumentRoiMarkers(img);
+
     for(const auto & config : configs) {
+        if(use_access_buffer) {
+            for(const auto & funcs : {config.adquire, config.release, config.try_adquire, config.destroy})
+                for(const auto & info : funcs)
+                    InstrumentContextRoutine(img, info.name.c_str(), (AFUNPTR) DrainAccessBuffer);
+
+            for(const std::string & adq_relFunc : config.adq_rel)
+                InstrumentContextRoutine(img, adq_relFunc.c_str(), (AFUNPTR) DrainAccessBuffer);
+        }
+
         for(const auto & adqConfig : config.adquire) {
             if(adqConfig.type == MUTEX)
                 InstrumentLockRoutine(img, (AFUNPTR) LockBefore, adqConfig);
@@ -1136,6 +1884,9 @@ COUNT_TIME_GENERIC(image_time, {
         for(const auto & try_adqConfig : config.try_adquire) {
             InstrumentLockRoutine(img, (AFUNPTR) TryLockBefore, try_adqConfig, (AFUNPTR) TryLockAfter);
         }
+        for(const auto & destroyConfig : config.destroy) {
+            InstrumentLockRoutine(img, (AFUNPTR) DestroyBefore, destroyConfig);
+        }
 
         uint64_t special_mutex = Lockset::register_special_mutex();
         for(const std::string & adq_relFunc : config.adq_rel) {
@@ -1173,19 +1924,25 @@ COUNT_TIME_GENERIC(image_time, {
 }) 
 }
 
+VOID ImageUnload(IMG img, VOID *v) {
+    code_filter.Unload(img);
+}
+
 template<typename Key, typename T>
 size_t get_map_size(const std::unordered_map<Key, T> &m) {
     return m.size() * (sizeof(Key) + sizeof(T));
 }
 
 VOID Fini(INT32 code, VOID *v) {
-    PIN_MutexFini(&variable_accessed_mutex);
+    PIN_MutexFini(&irh_ids_mutex);
     PIN_MutexFini(&thread_creation_mutex);
     PIN_MutexFini(&thread_exit_mutex);
     PIN_MutexFini(&lock_register_mutex);
     PIN_MutexFini(&lockset_cache_mutex);
     PIN_MutexFini(&timedlockset_cache_mutex);
-    PIN_MutexFini(&backtrace_mutex);
+    PIN_MutexFini(&pm_index_mutex);
+    PIN_MutexFini(&roi_mutex);
+    PIN_MutexFini(&cold_mutex);
 
     PIN_SemaphoreFini(&thread_creation_semaphore);  
 
@@ -1197,8 +1954,10 @@ VOID Fini(INT32 code, VOID *v) {
     size_t mem_state_size = 0;
     size_t access_point_size = 0;
     size_t vcs_n = 0;
+    size_t sampled_loads = 0;
+    size_t skipped_loads = 0;
     
-    for(int i = 0; i < TLS_MAX_SIZE; i++) {
+    for(uint64_t i = 0; i < analysis_data_tls.size(); i++) {
         ThreadData & thread_data = *get_thread_data(i);
 
         if(!thread_data.used)
@@ -1206,17 +1965,11 @@ VOID Fini(INT32 code, VOID *v) {
 
         n_rlps += thread_data.race_likely_stores.size();
         vcs_n += thread_data.vector_clocks.size();
+        sampled_loads += thread_data.sampled_loads;
+        skipped_loads += thread_data.skipped_loads;
         vector_cap += thread_data.race_likely_stores.capacity() * sizeof(StoreFenceData);
         access_point_size += get_map_size(thread_data.race_likely_loads);
-        mem_state_size += get_map_size(thread_data.mem_state);
-        mem_state_size += get_map_size(thread_data.flushed_mem_state);
-
-        for(const auto & it : thread_data.mem_state) {
-            mem_state_size += get_map_size(it.second);
-        }
-        for(const auto & it : thread_data.flushed_mem_state) {
-            mem_state_size += get_map_size(it.second);
-        }
+        mem_state_size += thread_data.mem_state.memory_size();
     }
 
 
@@ -1232,8 +1985,36 @@ VOID Fini(INT32 code, VOID *v) {
     std::cerr << "    Vector Clocks(#):    " << vcs_n << std::endl;
     std::cerr << "    Locksets(#):         " << locksets_cache.size() << std::endl;
     std::cerr << "    Timed Locksets(#):   " << timedlocksets_cache.size() << std::endl;
-    std::cerr << "    N allocs(#):         " << allocs.capacity() << std::endl;
-    std::cerr << "    IRH check(KB):       " << variable_accessed.size() * 16 / 1000 << std::endl;
+    std::cerr << "    N allocs(#):         " << allocs.size() << std::endl;
+    std::cerr << "    IRH check(KB):       " << irh_memory_size() / 1000 << std::endl;
+
+    if(use_private_lines) {
+        std::cerr << "    Shared lines(#):     " << line_owners.shared_lines() << " / " << line_owners.lines() << std::endl;
+        std::cerr << "    Line owners(KB):     " << line_owners.memory_size() / 1000 << std::endl;
+    }
+
+    if(adaptive_granularity) {
+        std::cerr << "    Refined lines(#):    " << adaptive_lines.refined_lines() << std::endl;
+        std::cerr << "    Adaptive lines(KB):  " << adaptive_lines.memory_size() / 1000 << std::endl;
+    }
+
+    if(cold_threshold) {
+        size_t n_cold = 0;
+        for(const auto & entry : ins_profiles)
+            n_cold += entry.second->cold;
+
+        std::cerr << "    Cold instructions(#): " << n_cold << " / " << ins_profiles.size() << std::endl;
+        std::cerr << "    Cold promotions(#):   " << cold_promotions << std::endl;
+        std::cerr << "    Cold flushes(#):      " << cold_flushes << std::endl;
+    }
+
+    if(sample_burst)
+        std::cerr << "    Sampled loads(#):     " << sampled_loads << " / " << sampled_loads + skipped_loads << std::endl;
+
+    if(code_filter.enabled()) {
+        std::cerr << "    Excluded images(#):   " << code_filter.excluded_images() << std::endl;
+        std::cerr << "    Excluded routines(#): " << code_filter.excluded_routines() << std::endl;
+    }
 
     std::cerr << std::endl;
 
@@ -1253,11 +2034,76 @@ void HandleKnobs() {
     use_init_removal_heuristic_n = (uint64_t) KnobInitRemoval.Value();
     backtrace_depth = (uint64_t) KnobBacktraceDepth.Value();
     check_unpersisted_stores = KnobCheckUnpersistedWrites.Value();
+    use_pm_prefilter = KnobPMPrefilter.Value();
+    pm_lazy_instrumentation = KnobLazyInstrumentation.Value();
+
+    if(!backtraceModes.contains(KnobBacktraceMode.Value())) {
+        PIN_ERROR("Unknown backtrace mode " + KnobBacktraceMode.Value() + "\n");
+        exit(-1);
+    }
+    backtrace_mode = backtraceModes[KnobBacktraceMode.Value()];
+
+    if(!granularities.contains(KnobGranularity.Value())) {
+        PIN_ERROR("Unknown granularity " + KnobGranularity.Value() + "\n");
+        exit(-1);
+    }
+    granularity_shift = granularities[KnobGranularity.Value()];
+    adaptive_granularity = KnobGranularity.Value() == "adaptive";
+
+    // only exact with the IRH, which ignores every access to a private line
+    use_private_lines = KnobPrivateLines.Value() && use_init_removal_heuristic_n != 0;
+
+    sample_burst = (uint32_t) std::max(KnobSampleBurst.Value(), 0);
+    sample_decay = (uint32_t) std::max(KnobSampleDecay.Value(), 1);
+    sample_max_period = (uint32_t) std::max(KnobSampleMaxPeriod.Value(), 1);
+    if(sample_burst)
+        debug("Sampling PM loads in bursts of %d (decay %d, down to 1/%d)\n", sample_burst, sample_decay, sample_max_period);
+
+    cold_threshold = (uint64_t) KnobColdThreshold.Value();
+    if(cold_threshold && use_pm_prefilter)
+        debug("Cold instructions are only reduced without the PM pre-filter\n");
+    else if(cold_threshold)
+        debug("Reducing instructions to a guard after %ld executions without PM\n", cold_threshold);
+
+    use_access_buffer = KnobBuffered.Value();
+    if(use_access_buffer) {
+        // Records are processed after the fact, only the shadow stack is still valid then
+        if(BacktraceNeedsContext()) {
+            PIN_ERROR("Buffered mode requires the shadow stack backtrace mode\n");
+            exit(-1);
+        }
+
+        access_buffer = PIN_DefineTraceBuffer(sizeof(AccessRecord), KnobBufferPages.Value(), AccessBufferFull, 0);
+
+        if(access_buffer == BUFFER_ID_INVALID) {
+            PIN_ERROR("Failed to allocate the access buffer\n");
+            exit(-1);
+        }
+
+        context_reg = PIN_ClaimToolRegister();
+
+        if(!REG_valid(context_reg)) {
+            PIN_ERROR("Failed to claim a tool register for the access buffer\n");
+            exit(-1);
+        }
+
+        debug("Buffering accesses (%d pages)\n", KnobBufferPages.Value());
+    }
+
+    backtrace_iargs = IARGLIST_Alloc();
+    if(BacktraceNeedsContext())
+        IARGLIST_AddArguments(backtrace_iargs, IARG_CONST_CONTEXT, IARG_END);
+    else
+        IARGLIST_AddArguments(backtrace_iargs, IARG_PTR, NULL, IARG_END);
 
     debug("Backtrace depth - %ld\n", backtrace_depth);
+    debug("Backtrace mode - %s\n", KnobBacktraceMode.Value().c_str());
     debug("Using Initialization Removal Heuristic for %ld threads\n", use_init_removal_heuristic_n);
+    debug("Tracking PM accesses per %s\n", KnobGranularity.Value().c_str());
     if(check_unpersisted_stores)
         debug("Checking unpersisted writes in analysis");
+    if(use_pm_prefilter)
+        debug("Using inlined PM pre-filter\n");
 
     std::vector<MutexConfig> *configs = new std::vector<MutexConfig>();
 
@@ -1266,7 +2112,40 @@ void HandleKnobs() {
         configs->emplace_back(KnobConfigFiles.Value(i));
     }
 
+    for(uint32_t i = 0; i < KnobIncludeImages.NumberOfValues(); i++)
+        code_filter.include_images.push_back(KnobIncludeImages.Value(i));
+    for(uint32_t i = 0; i < KnobExcludeImages.NumberOfValues(); i++)
+        code_filter.exclude_images.push_back(KnobExcludeImages.Value(i));
+    for(uint32_t i = 0; i < KnobIncludeRoutines.NumberOfValues(); i++)
+        code_filter.include_routines.push_back(KnobIncludeRoutines.Value(i));
+    for(uint32_t i = 0; i < KnobExcludeRoutines.NumberOfValues(); i++)
+        code_filter.exclude_routines.push_back(KnobExcludeRoutines.Value(i));
+
+    for(const auto & config : *configs) {
+        code_filter.include_images.insert(code_filter.include_images.end(), config.include_images.begin(), config.include_images.end());
+        code_filter.exclude_images.insert(code_filter.exclude_images.end(), config.exclude_images.begin(), config.exclude_images.end());
+        code_filter.include_routines.insert(code_filter.include_routines.end(), config.include_routines.begin(), config.include_routines.end());
+        code_filter.exclude_routines.insert(code_filter.exclude_routines.end(), config.exclude_routines.begin(), config.exclude_routines.end());
+    }
+
+    if(code_filter.enabled())
+        debug("Filtering instrumented images and routines\n");
+
+    for(uint32_t i = 0; i < KnobRoiStart.NumberOfValues(); i++)
+        roi_start_functions.push_back(KnobRoiStart.Value(i));
+    for(uint32_t i = 0; i < KnobRoiStop.NumberOfValues(); i++)
+        roi_stop_functions.push_back(KnobRoiStop.Value(i));
+    roi_start_icount = KnobRoiStartICount.Value();
+    roi_stop_icount = KnobRoiStopICount.Value();
+
+    RoiInit();
+    if(!roi_active)
+        debug("Waiting for the region of interest\n");
+    if(RoiCountsInstructions())
+        TRACE_AddInstrumentFunction(RoiTrace, 0);
+
     IMG_AddInstrumentFunction(ImageLoad, (void *) configs);
+    IMG_AddUnloadFunction(ImageUnload, 0);
 }
 
 int main(int argc, char *argv[]) {
@@ -1282,13 +2161,15 @@ int main(int argc, char *argv[]) {
 
     HandleKnobs();
 
-    PIN_MutexInit(&variable_accessed_mutex);
+    PIN_MutexInit(&irh_ids_mutex);
     PIN_MutexInit(&thread_creation_mutex);
     PIN_MutexInit(&thread_exit_mutex);
     PIN_MutexInit(&lock_register_mutex);
     PIN_MutexInit(&lockset_cache_mutex);
     PIN_MutexInit(&timedlockset_cache_mutex);
-    PIN_MutexInit(&backtrace_mutex);
+    PIN_MutexInit(&pm_index_mutex);
+    PIN_MutexInit(&roi_mutex);
+    PIN_MutexInit(&cold_mutex);
 
     PIN_SemaphoreInit(&thread_creation_semaphore);
 
@@ -1299,6 +2180,10 @@ int main(int argc, char *argv[]) {
     PIN_AddThreadStartFunction(TraceThreadStart, 0);
     PIN_AddThreadFiniFunction(TraceThreadExit, 0);
         
+    if(use_access_buffer)
+        PIN_AddSyscallEntryFunction(DrainAccessBufferSyscall, 0);
+    if(cold_threshold && !use_pm_prefilter)
+        PIN_AddSyscallEntryFunction(DemoteColdInstructionsSyscall, 0);
     PIN_AddSyscallEntryFunction(SyscallEntry, 0);
     PIN_AddSyscallExitFunction(SyscallExit, 0);
     
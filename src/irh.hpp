@@ -0,0 +1,303 @@
+#ifndef __HAWKSET_IRH_HPP__
+#define __HAWKSET_IRH_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+#include "pin.H"
+#include "thread_table.hpp"
+#include "granularity.hpp"
+#include "shadow.hpp"
+
+/* * *
+ *
+ * Initialization removal heuristic (IRH)
+ *
+ * Accesses to a byte are ignored until more than n threads accessed it, so
+ * the initialization of PM data by a single thread is not reported.
+ *
+ * The threads that accessed each PM granule are kept in shadow memory, a
+ * word per granule updated with CAS, so decisions neither lock nor allocate
+ * on the common path. With the adaptive granularity, lines that were not
+ * refined use a word per line. When the line is refined, the word is copied
+ * to the words of its bytes and then replaced by IRH_FORWARD, which sends
+ * later decisions on the line word to the bytes.
+ *
+ * Only the first n threads of a byte have to be remembered. The word holds
+ * up to three thread ids inline, more spill to a sorted set owned by the
+ * byte (with its own spin lock), so memory follows the threads that touched
+ * the byte. Once the limit is reached the word (or set) is saturated, every
+ * later access to the byte is kept.
+ *
+ * Threads get a compact id on their first decision. Ids are never reused,
+ * a new thread taken for an exited one would have its accesses ignored even
+ * when nothing orders the two threads.
+ *
+ * */
+
+// thread ids inline in a shadow word, 0 marks an empty slot
+#define IRH_INLINE_IDS 3
+#define IRH_ID_BITS 21
+#define IRH_MAX_THREADS ((1U << IRH_ID_BITS) - 1)
+
+// the word points to a spilled set
+#define IRH_SPILLED (1ULL << 63)
+
+// the spilled set is shared by the bytes of a refined line, and copied on change
+#define IRH_SHARED_SET (1ULL << 62)
+#define IRH_SET(word) ((IRHThreadSet *) ((word) & ~(IRH_SPILLED | IRH_SHARED_SET)))
+
+// the limit was reached for the byte
+#define IRH_SATURATED (~0ULL)
+
+// line word of a refined line
+#define IRH_FORWARD IRH_SPILLED
+
+enum IRHDecision {
+    IRH_KEEP,
+    IRH_IGNORE,
+    IRH_REFINED // the line was refined, decide on its bytes
+};
+
+uint64_t use_init_removal_heuristic_n = 1;
+
+typedef shadow_word_t irh_shadow_t;
+
+std::atomic<uint64_t> irh_spilled_sets = 0;
+
+// per granule of the tracking granularity, and per line for the coarse lines of the adaptive granularity
+ShadowMemory irh_shadow;
+ShadowMemory irh_line_shadow;
+
+/*
+    Threads of a byte past the inline slots. Never freed, as other threads
+    may still hold it, but emptied once saturated. The set of a line is
+    frozen when the line is refined, and then shared by its bytes.
+*/
+struct IRHThreadSet {
+    std::atomic_flag lock = ATOMIC_FLAG_INIT;
+    bool saturated = false;
+    bool frozen = false;
+    std::vector<uint32_t> ids; // sorted
+
+    // Same decision as IRHIgnore
+    IRHDecision ignore(uint32_t id) {
+        while(lock.test_and_set(std::memory_order_acquire))
+            ;
+
+        IRHDecision res = IRH_KEEP;
+
+        if(frozen) {
+            res = IRH_REFINED;
+        } else if(!saturated) {
+            auto it = std::lower_bound(ids.begin(), ids.end(), id);
+
+            if(it != ids.end() && *it == id) {
+                res = IRH_IGNORE;
+            } else if(ids.size() + 1 == use_init_removal_heuristic_n + 1) {
+                saturated = true;
+                std::vector<uint32_t>().swap(ids);
+            } else {
+                ids.insert(it, id);
+                res = IRH_IGNORE;
+            }
+        }
+
+        lock.clear(std::memory_order_release);
+        return res;
+    }
+};
+
+// id of each thread, 0 if it has none yet
+ThreadTable<std::atomic<uint32_t>> irh_thread_ids;
+uint32_t irh_n_threads = 0;
+
+PIN_MUTEX irh_ids_mutex;
+
+inline uint32_t IRHThreadId(uint64_t tid) {
+    uint32_t id = irh_thread_ids[tid].load(std::memory_order_relaxed);
+
+    if(id != 0)
+        return id;
+
+    PIN_MutexLock(&irh_ids_mutex);
+
+    // the id may be assigned by another thread, on behalf of this one
+    id = irh_thread_ids[tid].load(std::memory_order_relaxed);
+
+    if(id == 0) {
+        id = ++irh_n_threads;
+
+        assert(id <= IRH_MAX_THREADS);
+        irh_thread_ids[tid].store(id, std::memory_order_relaxed);
+    }
+
+    PIN_MutexUnlock(&irh_ids_mutex);
+    return id;
+}
+
+inline uint32_t irh_slot(uint64_t word, int i) {
+    return (word >> (i * IRH_ID_BITS)) & IRH_MAX_THREADS;
+}
+
+// Whether the access of the thread (id) to the byte (or coarse line) is ignored
+inline IRHDecision IRHIgnore(irh_shadow_t & shadow, uint32_t id) {
+    uint64_t word = shadow.load(std::memory_order_acquire);
+
+    while(true) {
+        // thread accessing the byte after the limit was reached
+        if(word == IRH_SATURATED)
+            return IRH_KEEP;
+
+        if(word == IRH_FORWARD)
+            return IRH_REFINED;
+
+        if((word & IRH_SPILLED) && !(word & IRH_SHARED_SET)) {
+            IRHDecision res = IRH_SET(word)->ignore(id);
+
+            // frozen by the refinement of the line, which is about to forward it
+            if(res == IRH_REFINED) {
+                word = shadow.load(std::memory_order_acquire);
+                continue;
+            }
+
+            return res;
+        }
+
+        // the shared set is immutable, the byte gets its own copy on its first new thread
+        if(word & IRH_SPILLED) {
+            const std::vector<uint32_t> & ids = IRH_SET(word)->ids;
+
+            if(std::binary_search(ids.begin(), ids.end(), id))
+                return IRH_IGNORE;
+
+            if(ids.size() + 1 == use_init_removal_heuristic_n + 1) {
+                if(shadow.compare_exchange_weak(word, IRH_SATURATED, std::memory_order_relaxed))
+                    return IRH_KEEP;
+                continue;
+            }
+
+            IRHThreadSet * set = new IRHThreadSet();
+            set->ids = ids;
+            set->ids.insert(std::lower_bound(set->ids.begin(), set->ids.end(), id), id);
+
+            if(shadow.compare_exchange_strong(word, (uint64_t) set | IRH_SPILLED, std::memory_order_release, std::memory_order_acquire)) {
+                irh_spilled_sets.fetch_add(1, std::memory_order_relaxed);
+                return IRH_IGNORE;
+            }
+
+            delete set;
+            continue;
+        }
+
+        int used = 0;
+        for(; used < IRH_INLINE_IDS && irh_slot(word, used) != 0; used++) {
+            // thread repeats access, does not count as new thread
+            if(irh_slot(word, used) == id)
+                return IRH_IGNORE;
+        }
+
+        // thread access limit reached
+        if((uint64_t) used + 1 == use_init_removal_heuristic_n + 1) {
+            if(shadow.compare_exchange_weak(word, IRH_SATURATED, std::memory_order_relaxed))
+                return IRH_KEEP;
+            continue;
+        }
+
+        if(used < IRH_INLINE_IDS) {
+            uint64_t next = word | ((uint64_t) id << (used * IRH_ID_BITS));
+
+            if(shadow.compare_exchange_weak(word, next, std::memory_order_relaxed))
+                return IRH_IGNORE;
+            continue;
+        }
+
+        IRHThreadSet * set = new IRHThreadSet();
+        for(int i = 0; i < IRH_INLINE_IDS; i++)
+            set->ids.push_back(irh_slot(word, i));
+        set->ids.push_back(id);
+        std::sort(set->ids.begin(), set->ids.end());
+
+        if(shadow.compare_exchange_strong(word, (uint64_t) set | IRH_SPILLED, std::memory_order_release, std::memory_order_acquire)) {
+            irh_spilled_sets.fetch_add(1, std::memory_order_relaxed);
+            return IRH_IGNORE;
+        }
+
+        delete set;
+    }
+}
+
+// Granules of the cache line (first bytes in bytes) whose access is not ignored
+inline uint64_t IRHFilterLine(uint64_t tid, uint64_t line, uint64_t bytes) {
+    uint32_t id = IRHThreadId(tid);
+
+    // the line word forwards to the bytes before the line is published as refined
+    if(adaptive_granularity && !adaptive_lines.refined(line)) {
+        IRHDecision decision = IRHIgnore(*irh_line_shadow.get(line >> 6), id);
+
+        if(decision != IRH_REFINED)
+            return decision == IRH_IGNORE ? 0 : bytes;
+    }
+
+    irh_shadow_t * shadow = irh_shadow.get(line >> granularity_shift);
+
+    for(uint64_t m = bytes; m; m &= m - 1) {
+        int b = __builtin_ctzll(m);
+
+        if(IRHIgnore(shadow[b >> granularity_shift], id) == IRH_IGNORE)
+            bytes &= ~(1ULL << b);
+    }
+
+    return bytes;
+}
+
+/*
+    The bytes of a refined line start from the state of the line. Only called
+    by the thread refining the line, before it is published as refined, and
+    nothing decides on the bytes before the line word forwards to them. The
+    line word is copied again until it is replaced by IRH_FORWARD unchanged,
+    a spilled set is frozen first and shared by the bytes.
+*/
+void IRHRefineLine(uint64_t line) {
+    irh_shadow_t & line_shadow = *irh_line_shadow.get(line >> 6);
+    irh_shadow_t * shadow = irh_shadow.get(line);
+
+    uint64_t word = line_shadow.load(std::memory_order_acquire);
+    uint64_t copied = 0;
+
+    while(true) {
+        uint64_t byte_word = word;
+
+        if(word != IRH_SATURATED && (word & IRH_SPILLED)) {
+            IRHThreadSet * set = IRH_SET(word);
+
+            while(set->lock.test_and_set(std::memory_order_acquire))
+                ;
+            set->frozen = true;
+            bool saturated = set->saturated;
+            set->lock.clear(std::memory_order_release);
+
+            byte_word = saturated ? IRH_SATURATED : word | IRH_SHARED_SET;
+        }
+
+        for(int b = 0; b < 64; b++) {
+            uint64_t expected = copied;
+            shadow[b].compare_exchange_strong(expected, byte_word, std::memory_order_release, std::memory_order_relaxed);
+        }
+
+        copied = byte_word;
+
+        if(line_shadow.compare_exchange_strong(word, IRH_FORWARD, std::memory_order_acq_rel, std::memory_order_acquire))
+            return;
+    }
+}
+
+size_t irh_memory_size() {
+    return irh_shadow.memory_size() + irh_line_shadow.memory_size() +
+           irh_spilled_sets.load() * sizeof(IRHThreadSet);
+}
+
+#endif
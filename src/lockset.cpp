@@ -1,23 +1,273 @@
 #include <cstring>
 #include <cassert>
+#include <algorithm>
 
 #include "pin.H"
 
 #include "lockset.hpp"
 
 PIN_MUTEX lock_register_mutex;
-std::map<uint64_t, uint64_t> Lockset::lock_index;
+LockIndex Lockset::lock_index;
 std::atomic_ulong Lockset::lock_counter;
+std::vector<uint64_t> Lockset::free_indexes;
+LockGenerations Lockset::lock_generations;
+
+#define LOCK_INDEX_MIN_CAPACITY 1024
+
+static inline size_t lock_index_slot(uint64_t mutex) {
+	return (mutex * 0x9E3779B97F4A7C15ULL) >> 32;
+}
+
+LockIndex::Table::Table(size_t capacity) :
+	mask(capacity - 1),
+	mutexes(new std::atomic<uint64_t>[capacity]()),
+	indexes(new std::atomic<uint64_t>[capacity]()) {}
+
+bool LockIndex::Table::find(uint64_t mutex, uint64_t & index) const {
+	for(size_t i = lock_index_slot(mutex) & mask;; i = (i + 1) & mask) {
+		uint64_t current = mutexes[i].load(std::memory_order_acquire);
+
+		if(current == mutex) {
+			index = indexes[i].load(std::memory_order_relaxed);
+			return true;
+		}
+
+		if(current == 0)
+			return false;
+	}
+}
+
+/*
+	Takes the first free slot of the probe sequence, empty or tombstone, the
+	mutex is known to be absent. The index is written before the mutex is
+	published.
+*/
+void LockIndex::Table::insert(uint64_t mutex, uint64_t index) {
+	size_t i = lock_index_slot(mutex) & mask;
+	uint64_t current;
+
+	while((current = mutexes[i].load(std::memory_order_relaxed)) != 0 && current != LOCK_INDEX_TOMBSTONE)
+		i = (i + 1) & mask;
+
+	indexes[i].store(index, std::memory_order_relaxed);
+	mutexes[i].store(mutex, std::memory_order_release);
+	if(current == 0)
+		size++;
+	live++;
+}
+
+// The slot stays used, so the probe sequences it is part of are kept
+bool LockIndex::Table::erase(uint64_t mutex, uint64_t & index) {
+	for(size_t i = lock_index_slot(mutex) & mask;; i = (i + 1) & mask) {
+		uint64_t current = mutexes[i].load(std::memory_order_relaxed);
+
+		if(current == mutex) {
+			index = indexes[i].load(std::memory_order_relaxed);
+			mutexes[i].store(LOCK_INDEX_TOMBSTONE, std::memory_order_release);
+			live--;
+			return true;
+		}
+
+		if(current == 0)
+			return false;
+	}
+}
+
+LockIndex::LockIndex() {
+	owned.reset(new Table(LOCK_INDEX_MIN_CAPACITY));
+	table.store(owned.get());
+}
+
+bool LockIndex::find(uint64_t mutex, uint64_t & index) {
+	THREADID tid = PIN_ThreadId();
+
+	// not an application thread, without a hazard pointer
+	if(tid == INVALID_THREADID) {
+		PIN_MutexLock(&lock_register_mutex);
+		bool found = find_locked(mutex, index);
+		PIN_MutexUnlock(&lock_register_mutex);
+		return found;
+	}
+
+	std::atomic<const Table *> & hazard = readers[tid];
+	const Table * t;
+
+	do {
+		t = table.load(std::memory_order_acquire);
+		hazard.store(t, std::memory_order_seq_cst);
+	} while(t != table.load(std::memory_order_seq_cst));
+
+	bool found = t->find(mutex, index);
+
+	hazard.store(nullptr, std::memory_order_release);
+
+	return found;
+}
+
+void LockIndex::reclaim() {
+	for(auto it = retired.begin(); it != retired.end();) {
+		bool in_use = false;
+
+		readers.for_each([&](uint64_t, const std::atomic<const Table *> & hazard) {
+			if(hazard.load(std::memory_order_seq_cst) == it->get())
+				in_use = true;
+		});
+
+		if(in_use)
+			++it;
+		else
+			it = retired.erase(it);
+	}
+}
+
+// Must be called with lock_register_mutex held
+void LockIndex::insert(uint64_t mutex, uint64_t index) {
+	Table * current = table.load(std::memory_order_relaxed);
+
+	// rebuilt without the tombstones, growing only if they were few
+	if((current->size + 1) * 2 > current->mask + 1) {
+		size_t capacity = LOCK_INDEX_MIN_CAPACITY;
+		while((current->live + 1) * 4 > capacity)
+			capacity *= 2;
+
+		Table * grown = new Table(capacity);
+
+		for_each([&](uint64_t m, uint64_t i) {
+			grown->insert(m, i);
+		});
+
+		table.store(grown, std::memory_order_seq_cst);
+		retired.push_back(std::move(owned));
+		owned.reset(grown);
+		current = grown;
+
+		reclaim();
+	}
+
+	current->insert(mutex, index);
+}
+
+// Must be called with lock_register_mutex held
+bool LockIndex::erase(uint64_t mutex, uint64_t & index) {
+	return table.load(std::memory_order_relaxed)->erase(mutex, index);
+}
+
+void LockGenerations::add(uint64_t index) {
+	uint64_t chunk = index >> LOCK_GENERATION_CHUNK_BITS;
+
+	assert(chunk < LOCK_GENERATION_MAX_CHUNKS);
+
+	if(chunks[chunk].load(std::memory_order_relaxed) == nullptr)
+		chunks[chunk].store(new std::atomic<uint32_t>[1ULL << LOCK_GENERATION_CHUNK_BITS](), std::memory_order_release);
+}
+
+void LockGenerations::bump(uint64_t index) {
+	chunks[index >> LOCK_GENERATION_CHUNK_BITS].load(std::memory_order_relaxed)
+		[index & ((1ULL << LOCK_GENERATION_CHUNK_BITS) - 1)].fetch_add(1, std::memory_order_release);
+}
+
+/*
+	A destroyed mutex only invalidates its own entry, through the generation
+	of its index. Destroying a mutex while another thread locks it is
+	undefined, so its generation does not change between register_mutex and
+	the read that follows.
+*/
+uint64_t LockIndexCache::get(uint64_t mutex) {
+	size_t slot = lock_index_slot(mutex) % LOCK_INDEX_CACHE_SIZE;
+
+	if(mutexes[slot] != mutex || Lockset::lock_generations.get(indexes[slot]) != generations[slot]) {
+		mutexes[slot] = mutex;
+		indexes[slot] = Lockset::register_mutex(mutex);
+		generations[slot] = Lockset::lock_generations.get(indexes[slot]);
+	}
+
+	return indexes[slot];
+}
+
+void Lockset::to_dense() {
+	locks.assign(inline_locks[n_inline - 1] / 64 + 1, 0);
+
+	for(uint32_t i = 0; i < n_inline; i++)
+		locks[inline_locks[i] / 64].set(inline_locks[i] % 64);
+
+	n_inline = 0;
+}
+
+// Back to the inline array once few enough locks are left
+void Lockset::normalize() {
+	if(!dense())
+		return;
+
+	uint64_t n = 0;
+	for(auto & v : locks) {
+		n += v.count();
+		if(n > LOCKSET_INLINE)
+			return;
+	}
+
+	uint64_t held[LOCKSET_INLINE];
+	uint32_t n_held = 0;
+	for_each([&](uint64_t index) {
+		held[n_held++] = index;
+	});
+
+	locks.clear();
+	memcpy(inline_locks, held, n_held * sizeof(uint64_t));
+	n_inline = n_held;
+}
+
+bool Lockset::contains(uint64_t index) const {
+	if(!dense()) {
+		for(uint32_t i = 0; i < n_inline; i++)
+			if(inline_locks[i] == index)
+				return true;
+
+		return false;
+	}
+
+	return index / 64 < locks.size() && locks[index / 64].test(index % 64);
+}
 
 void Lockset::set_mutex_internal(uint64_t index, bool val) {
+	if(!dense()) {
+		uint32_t pos = std::lower_bound(inline_locks, inline_locks + n_inline, index) - inline_locks;
+		bool present = pos < n_inline && inline_locks[pos] == index;
+
+		if(!val) {
+			if(present) {
+				memmove(inline_locks + pos, inline_locks + pos + 1, (n_inline - pos - 1) * sizeof(uint64_t));
+				n_inline--;
+			}
+			return;
+		}
+
+		if(present)
+			return;
+
+		if(n_inline < LOCKSET_INLINE) {
+			memmove(inline_locks + pos + 1, inline_locks + pos, (n_inline - pos) * sizeof(uint64_t));
+			inline_locks[pos] = index;
+			n_inline++;
+			return;
+		}
+
+		to_dense();
+	}
+
 	uint64_t macro = index / 64;
 	uint64_t micro = index % 64;
 
 	if (macro >= locks.size()) {
+		if(!val)
+			return;
+
 		locks.resize(macro+1, false);
 	}
 
 	locks[macro].set(micro, val); 
+
+	if(!val)
+		normalize();
 }
 
 void Lockset::set_mutex(uint64_t mutex, bool val) {
@@ -25,23 +275,55 @@ void Lockset::set_mutex(uint64_t mutex, bool val) {
 }
 
 
-void Lockset::register_mutex(uint64_t mutex) {
+uint64_t Lockset::register_mutex(uint64_t mutex) {
+	uint64_t index;
+
+	if(lock_index.find(mutex, index))
+		return index;
+
 	PIN_MutexLock(&lock_register_mutex);
-	if(!Lockset::lock_index.contains(mutex)) {
-		Lockset::lock_index[mutex] = lock_counter++;
+	if(!lock_index.find_locked(mutex, index)) {
+		if(free_indexes.empty()) {
+			index = lock_counter++;
+			lock_generations.add(index);
+		} else {
+			index = free_indexes.back();
+			free_indexes.pop_back();
+		}
+
+		lock_index.insert(mutex, index);
+	}
+	PIN_MutexUnlock(&lock_register_mutex);
+
+	return index;
+}
+
+// The index is reused by the next new mutex, the cache entries holding it become stale
+void Lockset::release_mutex(uint64_t mutex) {
+	uint64_t index;
+
+	PIN_MutexLock(&lock_register_mutex);
+	if(lock_index.erase(mutex, index)) {
+		free_indexes.push_back(index);
+		lock_generations.bump(index);
 	}
 	PIN_MutexUnlock(&lock_register_mutex);
 }
 
 uint64_t Lockset::get_index(uint64_t mutex) {
-	return Lockset::lock_index[mutex];
+	return register_mutex(mutex);
 }
 
 std::string Lockset::get_mutex_id(uint64_t index) {
-	for(const auto & entry : lock_index) {
-		if(entry.second == index)
-			return std::to_string(entry.first);
-	}
+	std::string id;
+
+	lock_index.for_each([&](uint64_t mutex, uint64_t i) {
+		if(i == index)
+			id = std::to_string(mutex);
+	});
+
+	if(!id.empty())
+		return id;
 
 	if(index < lock_counter)
 		return "S" + std::to_string(index);
@@ -62,12 +344,10 @@ void Lockset::unlock_special(uint64_t mutex) {
 }
 
 void Lockset::lock(uint64_t mutex) {
-	register_mutex(mutex);
 	set_mutex(mutex, true);
 }
 
 void Lockset::unlock(uint64_t mutex) {
-	register_mutex(mutex);
 	set_mutex(mutex, false);
 }
 
@@ -78,6 +358,17 @@ bool Lockset::short_intersect(const pLockset ls) const {
 	if(this == ls)
 		return true;
 
+	if(!dense() || !ls->dense()) {
+		const Lockset & small = dense() ? *ls : *this;
+		const Lockset & other = dense() ? *this : *ls;
+
+		for(uint32_t i = 0; i < small.n_inline; i++)
+			if(other.contains(small.inline_locks[i]))
+				return true;
+
+		return false;
+	}
+
 	uint64_t min_size = std::min(locks.size(), ls->locks.size());
 
 	for(size_t i = 0; i < min_size; i++) {
@@ -91,19 +382,21 @@ bool Lockset::short_intersect(const pLockset ls) const {
 }
 
 void Lockset::clear() {
+	n_inline = 0;
 	locks.clear();
 }
 
 bool Lockset::empty() const {
-	for(auto  &v : locks) {
-		if(v.any())
-			return false;
-	}
-
-	return true;
+	return !dense() && n_inline == 0;
 }
 
 bool Lockset::operator==(const Lockset& ls) const {
+	if(dense() != ls.dense())
+		return false;
+
+	if(!dense())
+		return n_inline == ls.n_inline && ! memcmp(inline_locks, ls.inline_locks, n_inline * sizeof(uint64_t));
+
 	if(locks.size() == ls.locks.size())
 		return ! memcmp(locks.data(), ls.locks.data(), locks.size() * sizeof(std::bitset<64>));
 
@@ -128,75 +421,144 @@ bool Lockset::operator!=(const Lockset& ls) const {
 }
 
 void Lockset::intersect(pLockset ls) {
+	if(this == ls)
+		return;
+
+	if(!dense() || !ls->dense()) {
+		const Lockset & small = dense() ? *ls : *this;
+		const Lockset & other = dense() ? *this : *ls;
+
+		uint64_t held[LOCKSET_INLINE];
+		uint32_t n_held = 0;
+		for(uint32_t i = 0; i < small.n_inline; i++)
+			if(other.contains(small.inline_locks[i]))
+				held[n_held++] = small.inline_locks[i];
+
+		locks.clear();
+		memcpy(inline_locks, held, n_held * sizeof(uint64_t));
+		n_inline = n_held;
+		return;
+	}
+
 	uint64_t min_size = std::min(this->locks.size(), ls->locks.size());
 
 	this->locks.resize(min_size);
 
 	for(size_t i = 0; i < min_size; i++) 
 		this->locks[i] = this->locks[i] & ls->locks[i]; 
+
+	normalize();
 }
 
 std::ostream& operator<<(std::ostream& os, const Lockset& ls) {
 	os << "LOCKSET: [ ";
-	for(const auto& entry : Lockset::lock_index) {
-		uint64_t lock_i = entry.second;
+	Lockset::lock_index.for_each([&](uint64_t mutex, uint64_t lock_i) {
+		if(ls.contains(lock_i)) {
+			os << mutex << " ";
+		}
+	});
+	os << "]";
 
+	return os;
+}
 
-		uint64_t macro = lock_i / 64;
-		uint64_t micro = lock_i % 64;
+uint32_t TimedLockset::lower_bound(uint64_t mutex) const {
+	const Entry * e = entries();
+	uint32_t i = 0;
 
-		if (macro >= ls.locks.size())
-			continue;
+	while(i < n && e[i].mutex < mutex)
+		i++;
 
-		if(ls.locks[macro].test(micro)) {
-			os << Lockset::get_mutex_id(lock_i) << " ";
-		}
+	return i;
+}
+
+// Moves the entries between the inline array and the vector when crossing TIMEDLOCKSET_INLINE
+void TimedLockset::resize(uint32_t size) {
+	if(size > TIMEDLOCKSET_INLINE) {
+		if(spilled.empty())
+			spilled.assign(inline_entries, inline_entries + n);
+
+		spilled.resize(size);
+	} else if(!spilled.empty()) {
+		memcpy(inline_entries, spilled.data(), size * sizeof(Entry));
+		spilled.clear();
 	}
-	os << "]";
 
-	return os;
+	n = size;
 }
 
 void TimedLockset::lock_special(uint64_t mutex, uint64_t timestamp) {
-	timestamps[mutex] = timestamp;
+	uint32_t pos = lower_bound(mutex);
+
+	if(pos < n && entries()[pos].mutex == mutex) {
+		entries()[pos].timestamp = timestamp;
+		return;
+	}
+
+	resize(n + 1);
+
+	Entry * e = entries();
+	memmove(e + pos + 1, e + pos, (n - pos - 1) * sizeof(Entry));
+	e[pos] = {mutex, timestamp};
 }
 
 void TimedLockset::unlock_special(uint64_t mutex) {
-	timestamps.erase(mutex);
+	uint32_t pos = lower_bound(mutex);
+
+	if(pos == n || entries()[pos].mutex != mutex)
+		return;
+
+	Entry * e = entries();
+	memmove(e + pos, e + pos + 1, (n - pos - 1) * sizeof(Entry));
+	resize(n - 1);
 }
 
 void TimedLockset::lock(uint64_t mutex, uint64_t timestamp) {
-	Lockset::register_mutex(mutex);
-	timestamps[Lockset::get_index(mutex)] = timestamp;
+	lock_special(Lockset::register_mutex(mutex), timestamp);
 }
 
 void TimedLockset::unlock(uint64_t mutex) {
-	Lockset::register_mutex(mutex);
-	timestamps.erase(Lockset::get_index(mutex));
+	unlock_special(Lockset::register_mutex(mutex));
 }
 
 void TimedLockset::clear() {
-	timestamps.clear();
+	n = 0;
+	spilled.clear();
 }
 
 
 bool TimedLockset::empty() const {
-	return timestamps.empty();
+	return n == 0;
 }
 
-void TimedLockset::intersect(pTimedLockset tls) {	
-	for(auto it = this->timestamps.begin(); it != this->timestamps.end();) {
-		if(!tls->timestamps.contains(it->first) || tls->timestamps.at(it->first) != it->second)
-			it = this->timestamps.erase(it);
-		else
-			++it;
-
+// Keeps the locks held with the same timestamp in both, merging the sorted entries in place
+void TimedLockset::intersect(pTimedLockset tls) {
+	if(this == tls)
+		return;
+
+	Entry * e = entries();
+	const Entry * other = tls->entries();
+	uint32_t kept = 0;
+
+	for(uint32_t i = 0, j = 0; i < n && j < tls->n;) {
+		if(e[i].mutex < other[j].mutex) {
+			i++;
+		} else if(other[j].mutex < e[i].mutex) {
+			j++;
+		} else {
+			if(e[i].timestamp == other[j].timestamp)
+				e[kept++] = e[i];
+			i++;
+			j++;
+		}
 	}
+
+	resize(kept);
 }
 
 
 bool TimedLockset::operator==(const TimedLockset& tls) const {
-	return this->timestamps == tls.timestamps;
+	return n == tls.n && ! memcmp(entries(), tls.entries(), n * sizeof(Entry));
 }
 bool TimedLockset::operator!=(const TimedLockset& tls) const {
 	return ! this->operator==(tls);
@@ -205,21 +567,18 @@ bool TimedLockset::operator!=(const TimedLockset& tls) const {
 Lockset TimedLockset::to_lockset() const {
 	Lockset result;
 
-	for(const auto & entry : this->timestamps) {
-		result.lock_special(entry.first);
-	}
+	for_each([&](uint64_t mutex, uint64_t) {
+		result.lock_special(mutex);
+	});
 
 	return result;
 }
 
 std::ostream& operator<<(std::ostream& os, const TimedLockset& tls) {
 	os << "TIMEDLOCKSET: [ ";
-	for(const auto& entry : tls.timestamps) {
-		uint64_t mutex = entry.first;
-		uint64_t ts = entry.second;
-
+	tls.for_each([&](uint64_t mutex, uint64_t ts) {
 		os << "(" << Lockset::get_mutex_id(mutex) << "->" << ts << ") ";
-	}
+	});
 	os << "]";
 
 	return os;
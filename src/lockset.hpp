@@ -3,7 +3,6 @@
 
 #include <iostream>
 #include <memory>
-#include <map>
 #include <cstdint>
 #include <bitset>
 #include <functional>
@@ -11,6 +10,8 @@
 #include <vector>
 #include <unordered_set>
 
+#include "thread_table.hpp"
+
 struct Lockset;
 struct TimedLockset;
 
@@ -19,21 +20,152 @@ typedef Lockset const * pLockset;
 
 extern PIN_MUTEX lock_register_mutex;
 
+#define LOCK_INDEX_TOMBSTONE (~0ULL)
+
+/*
+	Mutex address -> index, open addressing with linear probing.
+	Lookups do not lock, inserting a new mutex (and growing) or erasing a
+	destroyed one takes lock_register_mutex. Erased mutexes leave a
+	tombstone, reused by the next insert probing it. A rebuilt table
+	replaces the old one, which is freed once no lookup holds it
+	(per-thread hazard pointer, as in pm_index.hpp).
+*/
+class LockIndex {
+	struct Table {
+		size_t mask;
+		size_t size = 0; // used slots, including tombstones
+		size_t live = 0;
+		std::unique_ptr<std::atomic<uint64_t>[]> mutexes;
+		std::unique_ptr<std::atomic<uint64_t>[]> indexes;
+
+		Table(size_t capacity);
+		bool find(uint64_t mutex, uint64_t & index) const;
+		void insert(uint64_t mutex, uint64_t index);
+		bool erase(uint64_t mutex, uint64_t & index);
+	};
+
+	std::atomic<Table *> table;
+	std::unique_ptr<Table> owned;
+	std::vector<std::unique_ptr<Table>> retired;
+
+	ThreadTable<std::atomic<const Table *>> readers;
+
+	void reclaim();
+
+public:
+	LockIndex();
+
+	bool find(uint64_t mutex, uint64_t & index);
+
+	// Must be called with lock_register_mutex held
+	bool find_locked(uint64_t mutex, uint64_t & index) const {
+		return table.load(std::memory_order_relaxed)->find(mutex, index);
+	}
+
+	void insert(uint64_t mutex, uint64_t index);
+	bool erase(uint64_t mutex, uint64_t & index);
+
+	// f(mutex, index), must be called with lock_register_mutex held or after the execution
+	template<typename F>
+	void for_each(F f) const {
+		const Table * t = table.load(std::memory_order_acquire);
+
+		for(size_t i = 0; i <= t->mask; i++) {
+			uint64_t mutex = t->mutexes[i].load(std::memory_order_acquire);
+			if(mutex != 0 && mutex != LOCK_INDEX_TOMBSTONE)
+				f(mutex, t->indexes[i].load(std::memory_order_relaxed));
+		}
+	}
+};
+
+#define LOCK_GENERATION_CHUNK_BITS 12
+#define LOCK_GENERATION_MAX_CHUNKS (1U << 14)
+
+/*
+	Lock index -> number of times it was released, in chunks allocated as
+	register_mutex hands out new indexes.
+*/
+class LockGenerations {
+	std::atomic<std::atomic<uint32_t> *> chunks[LOCK_GENERATION_MAX_CHUNKS] = {};
+
+public:
+	uint32_t get(uint64_t index) const {
+		std::atomic<uint32_t> * chunk = chunks[index >> LOCK_GENERATION_CHUNK_BITS].load(std::memory_order_acquire);
+		return chunk ? chunk[index & ((1ULL << LOCK_GENERATION_CHUNK_BITS) - 1)].load(std::memory_order_acquire) : 0;
+	}
+
+	// Must be called with lock_register_mutex held
+	void add(uint64_t index);
+	void bump(uint64_t index);
+};
+
+#define LOCK_INDEX_CACHE_SIZE 16
+
+// Recent mutex -> index lookups of a thread, an entry is stale once its index is released
+struct LockIndexCache {
+	uint64_t mutexes[LOCK_INDEX_CACHE_SIZE] = {};
+	uint64_t indexes[LOCK_INDEX_CACHE_SIZE] = {};
+	uint32_t generations[LOCK_INDEX_CACHE_SIZE] = {};
+
+	uint64_t get(uint64_t mutex);
+};
+
+#define LOCKSET_INLINE 4
+
+/*
+	Held lock indexes, inline and sorted while there are at most
+	LOCKSET_INLINE of them, as a dense bitmap otherwise. The representation
+	only depends on the number of locks, so equal locksets compare (and hash)
+	the same way.
+*/
 class Lockset {
 public:
-	static std::map<uint64_t, uint64_t> lock_index;
+	static LockIndex lock_index;
 	static std::atomic_ulong lock_counter;
 
+	// indexes of destroyed mutexes, guarded by lock_register_mutex
+	static std::vector<uint64_t> free_indexes;
+	static LockGenerations lock_generations;
+
 	void set_mutex_internal(uint64_t index, bool val);
 	void set_mutex(uint64_t mutex, bool val);
 
-public:
-	std::vector<std::bitset<64>> locks = std::vector<std::bitset<64>>(1);
+private:
+	uint32_t n_inline = 0;
+	uint64_t inline_locks[LOCKSET_INLINE];
 
-	Lockset() {}
-	Lockset(pLockset ls) : locks(ls->locks) {}
+	// empty unless there are more than LOCKSET_INLINE locks
+	std::vector<std::bitset<64>> locks;
+
+	bool dense() const {
+		return !locks.empty();
+	}
+
+	void to_dense();
+	void normalize();
 
-	static void register_mutex(uint64_t mutex);
+public:
+	Lockset() {}
+	Lockset(pLockset ls) : Lockset(*ls) {}
+
+	bool contains(uint64_t index) const;
+
+	// f(index) for each held lock, in increasing order
+	template<typename F>
+	void for_each(F f) const {
+		if(!dense()) {
+			for(uint32_t i = 0; i < n_inline; i++)
+				f(inline_locks[i]);
+			return;
+		}
+
+		for(size_t macro = 0; macro < locks.size(); macro++)
+			for(uint64_t m = locks[macro].to_ullong(); m; m &= m - 1)
+				f(macro * 64 + __builtin_ctzll(m));
+	}
+
+	static uint64_t register_mutex(uint64_t mutex);
+	static void release_mutex(uint64_t mutex);
 	static uint64_t get_index(uint64_t mutex);
 	static std::string get_mutex_id(uint64_t index);
 	static uint64_t register_special_mutex();
@@ -56,14 +188,52 @@ public:
 friend class TimedLockset;
 };
 
+#define TIMEDLOCKSET_INLINE 4
+
+/*
+	Lock index -> acquisition timestamp, sorted by lock index. Inline while
+	there are at most TIMEDLOCKSET_INLINE locks, all of them spill to a
+	vector otherwise.
+*/
 class TimedLockset {
-public:
-	std::map<uint64_t, uint64_t> timestamps;
+	struct Entry {
+		uint64_t mutex;
+		uint64_t timestamp;
+	};
+
+	uint32_t n = 0;
+	Entry inline_entries[TIMEDLOCKSET_INLINE];
 
+	// empty unless there are more than TIMEDLOCKSET_INLINE locks
+	std::vector<Entry> spilled;
+
+	Entry * entries() {
+		return spilled.empty() ? inline_entries : spilled.data();
+	}
+
+	const Entry * entries() const {
+		return spilled.empty() ? inline_entries : spilled.data();
+	}
+
+	uint32_t lower_bound(uint64_t mutex) const;
+	void resize(uint32_t size);
+
+public:
 	TimedLockset() {}
-	TimedLockset(const std::map<uint64_t, uint64_t> & ts) : timestamps(ts) {}
-	TimedLockset(pTimedLockset tls) : timestamps(tls->timestamps) {}
-	
+	TimedLockset(pTimedLockset tls) : TimedLockset(*tls) {}
+
+	uint32_t size() const {
+		return n;
+	}
+
+	// f(mutex, timestamp) for each held lock, in increasing order
+	template<typename F>
+	void for_each(F f) const {
+		const Entry * e = entries();
+		for(uint32_t i = 0; i < n; i++)
+			f(e[i].mutex, e[i].timestamp);
+	}
+
 	void lock(uint64_t mutex, uint64_t timestamp);
 	void unlock(uint64_t mutex);
 	void lock_special(uint64_t mutex, uint64_t timestamp);
@@ -17,6 +17,7 @@
 
 #if defined(COUNT_INSTRUCTIONS) || defined(COUNT_TIME)
 #include "pin.H"
+#include "thread_table.hpp"
 
 struct alignas(64) LoggingData {
     uint64_t pm_stores = 0;
@@ -76,10 +77,10 @@ std::atomic_ulong image_time = 0;
 
 uint64_t tool_execution_tick = 0;
 
-LoggingData logging_tls[1000];
+ThreadTable<LoggingData> logging_tls;
 
 inline LoggingData * get_logging_data(uint64_t tid) {
-    return logging_tls + tid;
+    return &logging_tls[tid];
 }
 #endif
 
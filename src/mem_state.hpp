@@ -0,0 +1,422 @@
+#ifndef __HAWKSET_MEM_STATE_HPP__
+#define __HAWKSET_MEM_STATE_HPP__
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "lockset.hpp"
+#include "utils.hpp"
+
+/* * *
+ *
+ * Per-thread persistency state (simulated cache)
+ *
+ * Each cache line with pending stores has a single record, holding masks of
+ * the dirty bytes and of the flushed bytes waiting for a fence. Per byte and
+ * state, it keeps the index of the (timed lockset, backtrace) pair among the
+ * few distinct pairs stored to the line. A byte can be both flushed (older
+ * store) and dirty (newer store). Stores, overwrite checks and flushes are
+ * then mask operations on the record, a flush never moves the record.
+ *
+ * Records live in a flat open addressing table (linear probing), keyed by
+ * the cache line address. The lines with flushed bytes are also listed, so a
+ * fence does not scan the dirty lines.
+ *
+ * A fence does not clear the records it visits, it bumps the generation of
+ * the table instead: flushed bytes of an older generation are dropped when
+ * the record is next accessed. Records left empty are reused in place for
+ * other lines, and only dropped when the table is rehashed. Together with
+ * the recycled spill vectors, the store/flush/fence cycle does not allocate.
+ *
+ * */
+
+// StoreData from the algorithm described in atc's paper
+struct StoreData {
+    pTimedLockset timed_lockset;
+    backtrace_t backtrace;
+
+    bool operator==(const StoreData & other) const {
+        return timed_lockset == other.timed_lockset && backtrace == other.backtrace;
+    }
+};
+
+// Bytes [offset, offset + size) of a cache line
+inline uint64_t line_bytes(uint64_t offset, uint64_t size) {
+    return size >= 64 ? ~0ULL : (((1ULL << size) - 1) << offset);
+}
+
+#define LINE_INLINE_STORES 4
+#define LINE_MAX_STORES 255
+
+// Spill vectors of the records that were dropped, kept for reuse
+typedef std::vector<std::vector<StoreData> *> spill_pool_t;
+
+struct LineState {
+    uint64_t line = 0; // 0 marks an empty slot of the table
+    uint64_t dirty = 0;
+    uint64_t flushed = 0;
+
+    // generation of the table the flushed bytes belong to
+    uint32_t generation = 0;
+
+    // in the flushed lines list of the table
+    bool pending_fence = false;
+
+    uint8_t n_stores = 0;
+    uint8_t dirty_index[64];
+    uint8_t flushed_index[64];
+
+    StoreData local_stores[LINE_INLINE_STORES];
+    std::vector<StoreData> * spilled_stores = nullptr;
+
+    inline const StoreData & store(uint8_t i) const {
+        return i < LINE_INLINE_STORES ? local_stores[i] : (*spilled_stores)[i - LINE_INLINE_STORES];
+    }
+
+    bool empty() const {
+        return (dirty | flushed) == 0;
+    }
+
+    void set(uint64_t bytes, const StoreData & data, spill_pool_t & pool) {
+        dirty &= ~bytes;
+
+        uint8_t i = find_or_add(data, pool);
+
+        for(uint64_t m = bytes; m; m &= m - 1)
+            dirty_index[__builtin_ctzll(m)] = i;
+
+        dirty |= bytes;
+    }
+
+    // The dirty bytes replace the flushed ones, the stores are shared
+    void flush() {
+        if(flushed == 0) {
+            memcpy(flushed_index, dirty_index, sizeof(dirty_index));
+        } else {
+            for(uint64_t m = dirty; m; m &= m - 1) {
+                int b = __builtin_ctzll(m);
+                flushed_index[b] = dirty_index[b];
+            }
+        }
+
+        flushed |= dirty;
+        dirty = 0;
+    }
+
+    void clear_dirty(uint64_t bytes) {
+        dirty &= ~bytes;
+        release_stores();
+    }
+
+    void clear_flushed(uint64_t bytes) {
+        flushed &= ~bytes;
+        release_stores();
+    }
+
+    // f(address, store) for each dirty byte in bytes
+    template<typename F>
+    void for_each_dirty(uint64_t bytes, F f) const {
+        for(uint64_t m = dirty & bytes; m; m &= m - 1) {
+            int b = __builtin_ctzll(m);
+            f(line + b, store(dirty_index[b]));
+        }
+    }
+
+    // f(address, store) for each flushed byte in bytes
+    template<typename F>
+    void for_each_flushed(uint64_t bytes, F f) const {
+        for(uint64_t m = flushed & bytes; m; m &= m - 1) {
+            int b = __builtin_ctzll(m);
+            f(line + b, store(flushed_index[b]));
+        }
+    }
+
+    // f(bytes, store) once per distinct store, with its dirty (or flushed) bytes among bytes
+    template<typename F>
+    void for_each_store(uint64_t bytes, bool of_flushed, F f) const {
+        const uint8_t * index = of_flushed ? flushed_index : dirty_index;
+
+        uint64_t seen[4] = {};
+        uint64_t store_bytes[LINE_MAX_STORES];
+        uint8_t order[LINE_MAX_STORES];
+        int n = 0;
+
+        for(uint64_t m = (of_flushed ? flushed : dirty) & bytes; m; m &= m - 1) {
+            int b = __builtin_ctzll(m);
+            uint8_t i = index[b];
+
+            if(!(seen[i >> 6] & (1ULL << (i & 63)))) {
+                seen[i >> 6] |= 1ULL << (i & 63);
+                store_bytes[i] = 0;
+                order[n++] = i;
+            }
+
+            store_bytes[i] |= 1ULL << b;
+        }
+
+        for(int k = 0; k < n; k++)
+            f(store_bytes[order[k]], store(order[k]));
+    }
+
+    // Returns the spill vector to the pool
+    void release(spill_pool_t & pool) {
+        if(spilled_stores != nullptr) {
+            spilled_stores->clear();
+            pool.push_back(spilled_stores);
+            spilled_stores = nullptr;
+        }
+    }
+
+private:
+    inline StoreData & store(uint8_t i) {
+        return i < LINE_INLINE_STORES ? local_stores[i] : (*spilled_stores)[i - LINE_INLINE_STORES];
+    }
+
+    // The spill vector is kept (with its capacity) while the record lives
+    void release_stores() {
+        if(empty()) {
+            n_stores = 0;
+            if(spilled_stores != nullptr)
+                spilled_stores->clear();
+        }
+    }
+
+    uint8_t find_or_add(const StoreData & data, spill_pool_t & pool) {
+        // most often the same pair as the previous store
+        for(int i = n_stores - 1; i >= 0; i--)
+            if(store(i) == data)
+                return i;
+
+        // drop pairs no byte refers to anymore before growing
+        if(n_stores == LINE_INLINE_STORES || n_stores == LINE_MAX_STORES)
+            compact();
+
+        if(n_stores < LINE_INLINE_STORES) {
+            local_stores[n_stores] = data;
+        } else {
+            if(spilled_stores == nullptr) {
+                if(pool.empty()) {
+                    spilled_stores = new std::vector<StoreData>();
+                } else {
+                    spilled_stores = pool.back();
+                    pool.pop_back();
+                }
+            }
+
+            spilled_stores->resize(n_stores - LINE_INLINE_STORES);
+            spilled_stores->push_back(data);
+        }
+
+        return n_stores++;
+    }
+
+    // At most 127 pairs are referenced, 64 flushed and 63 dirty
+    void compact() {
+        uint8_t remap[LINE_MAX_STORES];
+        bool used[LINE_MAX_STORES] = {};
+
+        for(uint64_t m = dirty; m; m &= m - 1)
+            used[dirty_index[__builtin_ctzll(m)]] = true;
+        for(uint64_t m = flushed; m; m &= m - 1)
+            used[flushed_index[__builtin_ctzll(m)]] = true;
+
+        uint8_t n = 0;
+        for(uint8_t i = 0; i < n_stores; i++) {
+            if(used[i]) {
+                store(n) = store(i);
+                remap[i] = n++;
+            }
+        }
+
+        for(uint64_t m = dirty; m; m &= m - 1) {
+            int b = __builtin_ctzll(m);
+            dirty_index[b] = remap[dirty_index[b]];
+        }
+        for(uint64_t m = flushed; m; m &= m - 1) {
+            int b = __builtin_ctzll(m);
+            flushed_index[b] = remap[flushed_index[b]];
+        }
+
+        n_stores = n;
+
+        if(spilled_stores != nullptr)
+            spilled_stores->resize(n_stores > LINE_INLINE_STORES ? n_stores - LINE_INLINE_STORES : 0);
+    }
+};
+
+#define CACHE_STATE_MIN_CAPACITY 16
+
+class CacheState {
+    std::vector<LineState> table;
+    size_t n_lines = 0; // used slots, including empty records
+
+    std::vector<uint64_t> flushed_lines;
+    uint32_t generation = 1;
+
+    spill_pool_t spill_pool;
+
+    int shift = 64;
+
+    inline size_t slot(uint64_t line) const {
+        return ((line >> 6) * 0x9E3779B97F4A7C15ULL) >> shift;
+    }
+
+    inline size_t next(size_t i) const {
+        return (i + 1) & (table.size() - 1);
+    }
+
+    // Drops the flushed bytes of past generations
+    inline LineState & refresh(LineState & entry) {
+        if(entry.generation != generation) {
+            entry.generation = generation;
+            entry.pending_fence = false;
+            entry.clear_flushed(~0ULL);
+        }
+
+        return entry;
+    }
+
+    // Rehashes without the empty records, growing only if they were few
+    void rehash() {
+        std::vector<LineState> old = std::move(table);
+
+        size_t live = 0;
+        for(LineState & entry : old)
+            if(entry.line != 0 && !refresh(entry).empty())
+                live++;
+
+        size_t capacity = old.empty() ? CACHE_STATE_MIN_CAPACITY : old.size();
+        while((live + 1) * 4 > capacity)
+            capacity *= 2;
+
+        table = std::vector<LineState>(capacity);
+        shift = 64 - __builtin_ctzll(capacity);
+        n_lines = live;
+
+        for(LineState & entry : old) {
+            if(entry.line == 0)
+                continue;
+
+            if(entry.empty()) {
+                entry.release(spill_pool);
+                continue;
+            }
+
+            size_t i = slot(entry.line);
+            while(table[i].line != 0)
+                i = next(i);
+
+            table[i] = entry;
+        }
+    }
+
+public:
+    ~CacheState() {
+        for(LineState & entry : table)
+            entry.release(spill_pool);
+
+        for(std::vector<StoreData> * spilled : spill_pool)
+            delete spilled;
+    }
+
+    LineState * find(uint64_t line) {
+        if(n_lines == 0)
+            return nullptr;
+
+        for(size_t i = slot(line); table[i].line != 0; i = next(i))
+            if(table[i].line == line)
+                return &refresh(table[i]);
+
+        return nullptr;
+    }
+
+    // Inserts an empty record if the line has none
+    LineState & get(uint64_t line) {
+        if((n_lines + 1) * 2 > table.size())
+            rehash();
+
+        LineState * reusable = nullptr;
+
+        size_t i = slot(line);
+        for(; table[i].line != 0; i = next(i)) {
+            LineState & entry = refresh(table[i]);
+
+            if(entry.line == line)
+                return entry;
+
+            if(reusable == nullptr && entry.empty())
+                reusable = &entry;
+        }
+
+        // an empty record keeps the probe sequences it is part of intact
+        if(reusable != nullptr) {
+            reusable->line = line;
+            reusable->pending_fence = false;
+            return *reusable;
+        }
+
+        n_lines++;
+        table[i].line = line;
+        table[i].generation = generation;
+        return table[i];
+    }
+
+    void store(uint64_t line, uint64_t bytes, const StoreData & data) {
+        get(line).set(bytes, data, spill_pool);
+    }
+
+    void flush(uint64_t line) {
+        LineState * entry = find(line);
+
+        if(entry == nullptr || entry->dirty == 0)
+            return;
+
+        entry->flush();
+
+        if(!entry->pending_fence) {
+            entry->pending_fence = true;
+            flushed_lines.push_back(line);
+        }
+    }
+
+    bool has_flushed() const {
+        return !flushed_lines.empty();
+    }
+
+    // f(record) for each line with flushed bytes, which are then dropped
+    template<typename F>
+    void fence(F f) {
+        for(uint64_t line : flushed_lines) {
+            LineState * entry = find(line);
+
+            if(entry != nullptr && entry->flushed != 0)
+                f(*entry);
+        }
+
+        flushed_lines.clear();
+        generation++;
+    }
+
+    template<typename F>
+    void for_each_line(F f) {
+        for(LineState & entry : table)
+            if(entry.line != 0 && !refresh(entry).empty())
+                f(entry);
+    }
+
+    size_t memory_size() const {
+        size_t s = table.size() * sizeof(LineState) + flushed_lines.capacity() * sizeof(uint64_t);
+
+        for(const LineState & entry : table)
+            if(entry.spilled_stores != nullptr)
+                s += entry.spilled_stores->capacity() * sizeof(StoreData);
+
+        for(const std::vector<StoreData> * spilled : spill_pool)
+            s += spilled->capacity() * sizeof(StoreData);
+
+        return s;
+    }
+};
+
+#endif
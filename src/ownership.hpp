@@ -0,0 +1,129 @@
+#ifndef __HAWKSET_OWNERSHIP_HPP__
+#define __HAWKSET_OWNERSHIP_HPP__
+
+#include <atomic>
+#include <cstdint>
+
+#include "shadow.hpp"
+
+/* * *
+ *
+ * Thread-private cache lines
+ *
+ * Records the first thread to access each PM cache line, and the bytes it
+ * accessed, until a second thread accesses the line. While a line is private
+ * to its first thread, the IRH ignores every access to it, so the thread can
+ * skip the IRH and everything it would have filtered out (access points,
+ * overwrite checks, fence and exit records), only keeping the persistency
+ * state of its stores.
+ *
+ * The bytes of the first thread are the summary of the private period. The
+ * second thread marks the line as being shared, materializes the summary in
+ * the IRH, as if the first thread had gone through it, and only then marks
+ * it shared; accesses that see the line being shared wait for it. The first
+ * thread re-checks the line after adding bytes to the summary, so they are
+ * either materialized by the second thread or taken through the IRH by the
+ * first one (which ignores repeated accesses of a thread).
+ *
+ * The owner and its bytes are adjacent shadow words, found with one lookup,
+ * and the bytes are only written when an access adds new ones.
+ *
+ * */
+
+#define LINE_SHARED (~0ULL)
+#define LINE_SHARING (~0ULL - 1)
+
+enum LineAccess {LINE_PRIVATE, LINE_IS_SHARED, LINE_BECAME_SHARED};
+
+class LineOwners {
+    // per line: tid + 1 of the first thread (or LINE_SHARING, LINE_SHARED), bytes of the first thread
+    ShadowMemory shadow;
+
+    std::atomic<uint64_t> n_lines = 0;
+    std::atomic<uint64_t> n_shared = 0;
+
+    static uint64_t wait_shared(shadow_word_t & owner, uint64_t word) {
+        while(word == LINE_SHARING)
+            word = owner.load(std::memory_order_acquire);
+
+        return word;
+    }
+
+public:
+    /*
+        LINE_BECAME_SHARED hands the first thread and its bytes to the caller,
+        which must materialize them and then call shared().
+    */
+    LineAccess access(uint64_t tid, uint64_t line, uint64_t bytes, uint64_t & owner, uint64_t & owner_bytes) {
+        shadow_word_t * words = shadow.get((line >> 6) << 1);
+        shadow_word_t & word = words[0];
+        shadow_word_t & touched = words[1];
+
+        uint64_t self = tid + 1;
+        uint64_t current = word.load(std::memory_order_acquire);
+
+        while(true) {
+            if(current == LINE_SHARED || current == LINE_SHARING) {
+                wait_shared(word, current);
+                return LINE_IS_SHARED;
+            }
+
+            if(current == 0) {
+                if(!word.compare_exchange_weak(current, self, std::memory_order_acq_rel))
+                    continue;
+
+                n_lines.fetch_add(1, std::memory_order_relaxed);
+                current = self;
+            }
+
+            if(current == self) {
+                if((touched.load(std::memory_order_relaxed) & bytes) == bytes)
+                    return LINE_PRIVATE;
+
+                // seq_cst pairs with the marking below
+                touched.fetch_or(bytes, std::memory_order_seq_cst);
+                current = word.load(std::memory_order_seq_cst);
+
+                if(current == self)
+                    return LINE_PRIVATE;
+
+                wait_shared(word, current);
+                return LINE_IS_SHARED;
+            }
+
+            if(word.compare_exchange_weak(current, LINE_SHARING, std::memory_order_seq_cst))
+                break;
+        }
+
+        n_shared.fetch_add(1, std::memory_order_relaxed);
+
+        owner = current - 1;
+        owner_bytes = touched.load(std::memory_order_seq_cst);
+        return LINE_BECAME_SHARED;
+    }
+
+    // The summary of a line that became shared was materialized
+    void shared(uint64_t line) {
+        shadow.get((line >> 6) << 1)->store(LINE_SHARED, std::memory_order_release);
+    }
+
+    bool is_private(uint64_t tid, uint64_t line) {
+        return shadow.get((line >> 6) << 1)->load(std::memory_order_acquire) == tid + 1;
+    }
+
+    uint64_t lines() const {
+        return n_lines.load();
+    }
+
+    uint64_t shared_lines() const {
+        return n_shared.load();
+    }
+
+    size_t memory_size() const {
+        return shadow.memory_size();
+    }
+};
+
+LineOwners line_owners;
+
+#endif
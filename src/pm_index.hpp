@@ -0,0 +1,275 @@
+#ifndef __HAWKSET_PM_INDEX_HPP__
+#define __HAWKSET_PM_INDEX_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "pin.H"
+#include "thread_table.hpp"
+#include "logger.hpp"
+
+/* * *
+ *
+ * Read-mostly index of the PM mapped address ranges
+ *
+ * Lookups run on every memory access, while the index only changes on
+ * mmap/munmap of a PM file. Readers work on an immutable, sorted snapshot
+ * of the ranges, which writers replace as a whole (RCU style). A retired
+ * snapshot is freed once no reader holds it (per-thread hazard pointer).
+ *
+ * Each thread also caches the last interval it classified, either a PM
+ * range or the gap between two ranges, so repeated accesses to the same
+ * region are answered without touching the snapshot.
+ *
+ * */
+
+struct PMRange {
+    uint64_t start;
+    uint64_t end;
+};
+
+struct PMSnapshot {
+    uint64_t version = 0;
+    std::vector<PMRange> ranges; // sorted by start, non overlapping
+};
+
+struct alignas(64) PMReader {
+    std::atomic<const PMSnapshot *> hazard = nullptr;
+
+    // last classified interval [start, end)
+    uint64_t version = 0;
+    uint64_t start = 0;
+    uint64_t end = 0;
+    bool is_pm = false;
+};
+
+PIN_MUTEX pm_index_mutex;
+
+/*
+ * Smallest interval covering every PM range, in 2MB units, kept outside the
+ * index for the inlined pre-filter. The first unit and the number of units
+ * are packed in one word, so a reader never sees the bounds of two different
+ * envelopes. The span saturates at 512TB.
+ */
+#define PM_ENVELOPE_UNIT_BITS 21
+#define PM_ENVELOPE_SPAN_BITS 28
+#define PM_ENVELOPE_SPAN_MASK ((1ULL << PM_ENVELOPE_SPAN_BITS) - 1)
+
+std::atomic<uint64_t> pm_envelope = 0;
+
+inline bool EnvelopeContains(uint64_t envelope, uint64_t address) {
+    return ((address >> PM_ENVELOPE_UNIT_BITS) - (envelope >> PM_ENVELOPE_SPAN_BITS)) <
+           (envelope & PM_ENVELOPE_SPAN_MASK);
+}
+
+// Envelope of [start, end), empty if end == start
+inline uint64_t MakeEnvelope(uint64_t start, uint64_t end) {
+    if(end <= start)
+        return 0;
+
+    uint64_t low = start >> PM_ENVELOPE_UNIT_BITS;
+    uint64_t high = (end + (1ULL << PM_ENVELOPE_UNIT_BITS) - 1) >> PM_ENVELOPE_UNIT_BITS;
+
+    return (low << PM_ENVELOPE_SPAN_BITS) | std::min<uint64_t>(high - low, PM_ENVELOPE_SPAN_MASK);
+}
+
+inline uint64_t EnvelopeUnion(uint64_t a, uint64_t b) {
+    if((a & PM_ENVELOPE_SPAN_MASK) == 0)
+        return b;
+    if((b & PM_ENVELOPE_SPAN_MASK) == 0)
+        return a;
+
+    uint64_t low = std::min(a >> PM_ENVELOPE_SPAN_BITS, b >> PM_ENVELOPE_SPAN_BITS);
+    uint64_t high = std::max((a >> PM_ENVELOPE_SPAN_BITS) + (a & PM_ENVELOPE_SPAN_MASK),
+                             (b >> PM_ENVELOPE_SPAN_BITS) + (b & PM_ENVELOPE_SPAN_MASK));
+
+    return (low << PM_ENVELOPE_SPAN_BITS) | std::min<uint64_t>(high - low, PM_ENVELOPE_SPAN_MASK);
+}
+
+/*
+ * Memory accesses are only instrumented while some PM is mapped, the code
+ * cache is flushed whenever the index becomes empty or stops being empty
+ */
+bool pm_lazy_instrumentation = false;
+
+class PMIndex {
+    std::atomic<const PMSnapshot *> current = new PMSnapshot();
+    std::atomic<uint64_t> version = 0;
+    std::atomic<size_t> n_ranges = 0;
+
+    std::vector<const PMSnapshot *> retired;
+
+    ThreadTable<PMReader> readers;
+
+    // Must be called with pm_index_mutex held
+    void publish(PMSnapshot * snapshot) {
+        const PMSnapshot * old = current.load(std::memory_order_relaxed);
+
+        snapshot->version = old->version + 1;
+
+        uint64_t envelope = 0;
+        if(!snapshot->ranges.empty())
+            envelope = MakeEnvelope(snapshot->ranges.front().start, snapshot->ranges.back().end);
+
+        // never narrower than the live ranges: widened before the snapshot is published, narrowed after
+        pm_envelope.store(EnvelopeUnion(pm_envelope.load(std::memory_order_relaxed), envelope), std::memory_order_seq_cst);
+
+        current.store(snapshot, std::memory_order_seq_cst);
+        version.store(snapshot->version, std::memory_order_release);
+        n_ranges.store(snapshot->ranges.size(), std::memory_order_release);
+
+        pm_envelope.store(envelope, std::memory_order_release);
+
+        if(pm_lazy_instrumentation && old->ranges.empty() != snapshot->ranges.empty()) {
+            debug("%s memory instrumentation\n", old->ranges.empty() ? "Enabling" : "Disabling");
+            PIN_RemoveInstrumentation();
+        }
+
+        retired.push_back(old);
+        reclaim();
+    }
+
+    void reclaim() {
+        for(auto it = retired.begin(); it != retired.end();) {
+            bool in_use = false;
+
+            readers.for_each([&](uint64_t, const PMReader & reader) {
+                if(reader.hazard.load(std::memory_order_seq_cst) == *it)
+                    in_use = true;
+            });
+
+            if(in_use) {
+                ++it;
+            } else {
+                delete *it;
+                it = retired.erase(it);
+            }
+        }
+    }
+
+    // Ranges of old without [start, end), splitting the ones partially covered
+    static PMSnapshot * without(const PMSnapshot * old, uint64_t start, uint64_t end) {
+        PMSnapshot * snapshot = new PMSnapshot();
+
+        for(const PMRange & range : old->ranges) {
+            if(range.end <= start || range.start >= end) {
+                snapshot->ranges.push_back(range);
+                continue;
+            }
+
+            if(range.start < start)
+                snapshot->ranges.push_back({range.start, start});
+
+            if(range.end > end)
+                snapshot->ranges.push_back({end, range.end});
+        }
+
+        return snapshot;
+    }
+
+public:
+    // A mapping placed over live ranges (MAP_FIXED) replaces the parts it covers
+    void insert(uint64_t start, uint64_t end) {
+        PIN_MutexLock(&pm_index_mutex);
+
+        PMSnapshot * snapshot = without(current.load(std::memory_order_relaxed), start, end);
+        auto & ranges = snapshot->ranges;
+
+        auto it = std::lower_bound(ranges.begin(), ranges.end(), start,
+            [](const PMRange & r, uint64_t a) { return r.start < a; });
+        ranges.insert(it, {start, end});
+
+        publish(snapshot);
+
+        PIN_MutexUnlock(&pm_index_mutex);
+    }
+
+    // Removes [start, end) from the index, splitting ranges partially unmapped
+    void remove(uint64_t start, uint64_t end) {
+        PIN_MutexLock(&pm_index_mutex);
+
+        const PMSnapshot * old = current.load(std::memory_order_relaxed);
+
+        bool overlaps = std::any_of(old->ranges.begin(), old->ranges.end(),
+            [=](const PMRange & r) { return r.start < end && r.end > start; });
+
+        // munmap of memory that is not PM, nothing to publish
+        if(!overlaps) {
+            PIN_MutexUnlock(&pm_index_mutex);
+            return;
+        }
+
+        publish(without(old, start, end));
+
+        PIN_MutexUnlock(&pm_index_mutex);
+    }
+
+    size_t size() const {
+        return n_ranges.load(std::memory_order_acquire);
+    }
+
+    bool contains(uint64_t tid, uint64_t address, uint64_t range_end) {
+        PMReader & reader = readers[tid];
+
+        if(reader.version == version.load(std::memory_order_acquire) &&
+           address >= reader.start && range_end <= reader.end) {
+            return reader.is_pm;
+        }
+
+        const PMSnapshot * snapshot;
+        do {
+            snapshot = current.load(std::memory_order_acquire);
+            reader.hazard.store(snapshot, std::memory_order_seq_cst);
+        } while(snapshot != current.load(std::memory_order_seq_cst));
+
+        const auto & ranges = snapshot->ranges;
+
+        // first range starting after the address
+        auto it = std::upper_bound(ranges.begin(), ranges.end(), address,
+            [](uint64_t a, const PMRange & r) { return a < r.start; });
+
+        uint64_t gap_start = 0;
+        uint64_t gap_end = it == ranges.end() ? UINT64_MAX : it->start;
+        bool res = false;
+
+        if(it != ranges.begin()) {
+            const PMRange & range = *(it - 1);
+
+            if(address < range.end) {
+                res = range_end <= range.end;
+
+                if(res) {
+                    reader.start = range.start;
+                    reader.end = range.end;
+                    reader.is_pm = true;
+                    reader.version = snapshot->version;
+                }
+
+                reader.hazard.store(nullptr, std::memory_order_release);
+                return res;
+            }
+
+            gap_start = range.end;
+        }
+
+        if(range_end <= gap_end) {
+            reader.start = gap_start;
+            reader.end = gap_end;
+            reader.is_pm = false;
+            reader.version = snapshot->version;
+        }
+
+        reader.hazard.store(nullptr, std::memory_order_release);
+        return res;
+    }
+};
+
+PMIndex pm_index;
+
+inline bool PMInstrumentationEnabled() {
+    return !pm_lazy_instrumentation || pm_index.size() > 0;
+}
+
+#endif
@@ -0,0 +1,152 @@
+#ifndef __HAWKSET_ROI_HPP__
+#define __HAWKSET_ROI_HPP__
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "pin.H"
+#include "logger.hpp"
+#include "thread_table.hpp"
+
+/* * *
+ *
+ * Region of interest
+ *
+ * The ROI is entered and left at marker functions or at a (process wide)
+ * instruction count. Outside of it, loads and stores are not instrumented at
+ * all, every transition flushes the code cache so the instrumentation is
+ * reinserted or removed.
+ *
+ * Synchronization (locks, thread creation and join), flushes and fences are
+ * always tracked, so vector clocks and locksets are sound when the ROI starts.
+ *
+ * Instructions are counted per thread and only added to the process count
+ * every ROI_ICOUNT_CHUNK instructions, so a transition may happen up to that
+ * many instructions (per thread) late.
+ *
+ * */
+
+std::vector<std::string> roi_start_functions;
+std::vector<std::string> roi_stop_functions;
+uint64_t roi_start_icount = 0;
+uint64_t roi_stop_icount = 0;
+
+std::atomic<bool> roi_active = true;
+
+std::atomic<uint64_t> roi_icount = 0;
+std::atomic<uint64_t> roi_next_icount = UINT64_MAX;
+
+#define ROI_ICOUNT_CHUNK 4096
+
+// Instructions of a thread not added to roi_icount yet
+struct alignas(64) RoiThreadCount {
+    uint64_t count = 0;
+};
+
+ThreadTable<RoiThreadCount> roi_thread_icount;
+
+PIN_MUTEX roi_mutex;
+
+inline bool RoiCountsInstructions() {
+    return roi_start_icount != 0 || roi_stop_icount != 0;
+}
+
+// Must be called with roi_mutex held
+void RoiUpdateNextICount() {
+    uint64_t icount = roi_icount.load(std::memory_order_relaxed);
+
+    if(!roi_active && roi_start_icount > icount)
+        roi_next_icount = roi_start_icount;
+    else if(roi_active && roi_stop_icount > icount)
+        roi_next_icount = roi_stop_icount;
+    else
+        roi_next_icount = UINT64_MAX;
+}
+
+void RoiInit() {
+    roi_active = roi_start_functions.empty() && roi_start_icount == 0;
+    RoiUpdateNextICount();
+}
+
+// Must be called with roi_mutex held
+void _SetROI(bool active) {
+    if(roi_active.exchange(active) != active) {
+        debug("%s region of interest (%ld instructions)\n", active ? "Entering" : "Leaving", roi_icount.load());
+        PIN_RemoveInstrumentation();
+    }
+
+    RoiUpdateNextICount();
+}
+
+void RoiStart() {
+    PIN_MutexLock(&roi_mutex);
+    _SetROI(true);
+    PIN_MutexUnlock(&roi_mutex);
+}
+
+void RoiStop() {
+    PIN_MutexLock(&roi_mutex);
+    _SetROI(false);
+    PIN_MutexUnlock(&roi_mutex);
+}
+
+// The counter of the thread exists before its first basic block
+void RoiThreadStart(THREADID tid) {
+    roi_thread_icount[tid].count = 0;
+}
+
+ADDRINT PIN_FAST_ANALYSIS_CALL RoiCountInstructions(THREADID tid, UINT32 n) {
+    return (roi_thread_icount.lookup(tid).count += n) >= ROI_ICOUNT_CHUNK;
+}
+
+void RoiAddInstructions(THREADID tid) {
+    uint64_t n = roi_thread_icount[tid].count;
+    roi_thread_icount[tid].count = 0;
+
+    if(roi_icount.fetch_add(n, std::memory_order_relaxed) + n < roi_next_icount.load(std::memory_order_relaxed))
+        return;
+
+    PIN_MutexLock(&roi_mutex);
+
+    // another thread may have handled it already
+    if(roi_icount.load(std::memory_order_relaxed) >= roi_next_icount.load())
+        _SetROI(!roi_active);
+
+    PIN_MutexUnlock(&roi_mutex);
+}
+
+VOID RoiTrace(TRACE trace, VOID *v) {
+    if(roi_next_icount.load(std::memory_order_relaxed) == UINT64_MAX)
+        return;
+
+    for(BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
+        BBL_InsertIfCall(bbl, IPOINT_BEFORE, (AFUNPTR) RoiCountInstructions,
+                         IARG_FAST_ANALYSIS_CALL,
+                         IARG_THREAD_ID,
+                         IARG_UINT32, BBL_NumIns(bbl),
+                         IARG_END);
+        BBL_InsertThenCall(bbl, IPOINT_BEFORE, (AFUNPTR) RoiAddInstructions,
+                           IARG_THREAD_ID,
+                           IARG_END);
+    }
+}
+
+void InstrumentRoiMarkers(IMG img) {
+    for(const auto & [names, marker] : {std::make_pair(&roi_start_functions, (AFUNPTR) RoiStart),
+                                        std::make_pair(&roi_stop_functions, (AFUNPTR) RoiStop)}) {
+        for(const std::string & name : *names) {
+            RTN routine = RTN_FindByName(img, name.c_str());
+            if(!RTN_Valid(routine))
+                continue;
+
+            debug("Instrument ROI marker %s\n", name.c_str());
+            RTN_Open(routine);
+            RTN_InsertCall(routine, IPOINT_BEFORE, marker, IARG_END);
+            RTN_Close(routine);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef __HAWKSET_SHADOW_HPP__
+#define __HAWKSET_SHADOW_HPP__
+
+#include <sys/mman.h>
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+
+/* * *
+ *
+ * Direct mapped shadow memory
+ *
+ * A 64 bit word per index (address of a PM granule), zero until written.
+ * Shadow pages hold the words of 4K consecutive indexes and are mmapped on
+ * their first access, through a two level directory covering the indexes of
+ * the user address space, also mmapped lazily. Entries are installed with
+ * CAS, so lookups never lock.
+ *
+ * */
+
+#define SHADOW_PAGE_BITS 12
+#define SHADOW_DIR_BITS 18
+#define SHADOW_INDEX_BITS 48
+
+typedef std::atomic<uint64_t> shadow_word_t;
+
+class ShadowMemory {
+    typedef std::atomic<shadow_word_t *> dir_entry_t;
+
+    std::atomic<dir_entry_t *> directory[1ULL << (SHADOW_INDEX_BITS - SHADOW_PAGE_BITS - SHADOW_DIR_BITS)] = {};
+
+    std::atomic<uint64_t> n_pages = 0;
+
+    // Zeroed anonymous memory, pages are only backed once touched
+    static void * Map(size_t size) {
+        void * p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        assert(p != MAP_FAILED);
+        return p;
+    }
+
+    // Another thread may install the same entry, the loser unmaps its own
+    template<typename T>
+    static T * Install(std::atomic<T *> & entry, size_t size, bool & installed) {
+        T * current = entry.load(std::memory_order_acquire);
+        installed = false;
+
+        if(current != nullptr)
+            return current;
+
+        T * fresh = (T *) Map(size);
+
+        if(entry.compare_exchange_strong(current, fresh, std::memory_order_acq_rel, std::memory_order_acquire)) {
+            installed = true;
+            return fresh;
+        }
+
+        munmap(fresh, size);
+        return current;
+    }
+
+public:
+    // Word of the index, those of the following indexes of its page are contiguous
+    shadow_word_t * get(uint64_t index) {
+        assert(index < (1ULL << SHADOW_INDEX_BITS));
+
+        uint64_t page = index >> SHADOW_PAGE_BITS;
+        bool installed;
+
+        dir_entry_t * dir = Install(directory[page >> SHADOW_DIR_BITS],
+                                    sizeof(dir_entry_t) << SHADOW_DIR_BITS, installed);
+
+        shadow_word_t * shadow = Install(dir[page & ((1ULL << SHADOW_DIR_BITS) - 1)],
+                                         sizeof(shadow_word_t) << SHADOW_PAGE_BITS, installed);
+
+        if(installed)
+            n_pages.fetch_add(1, std::memory_order_relaxed);
+
+        return shadow + (index & ((1ULL << SHADOW_PAGE_BITS) - 1));
+    }
+
+    size_t memory_size() const {
+        return n_pages.load() * (sizeof(shadow_word_t) << SHADOW_PAGE_BITS);
+    }
+};
+
+#endif
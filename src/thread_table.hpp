@@ -0,0 +1,88 @@
+#ifndef __HAWKSET_THREAD_TABLE_HPP__
+#define __HAWKSET_THREAD_TABLE_HPP__
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+
+/* * *
+ *
+ * Per-thread tables
+ *
+ * PIN thread ids keep growing as the application creates threads, so the
+ * state kept per thread id cannot be a fixed array. Entries live in chunks
+ * of consecutive ids, allocated (value initialized) when one of their ids is
+ * first used and installed with CAS. Chunks are never freed, so entries do
+ * not move and lookups never lock.
+ *
+ * */
+
+#define THREAD_TABLE_CHUNK_BITS 6
+#define THREAD_TABLE_MAX_THREADS (1U << 21)
+
+template<typename T>
+class ThreadTable {
+    static constexpr uint64_t chunk_size = 1ULL << THREAD_TABLE_CHUNK_BITS;
+
+    std::atomic<T *> chunks[THREAD_TABLE_MAX_THREADS >> THREAD_TABLE_CHUNK_BITS] = {};
+
+    // ids up to the end of the last allocated chunk
+    std::atomic<uint64_t> n_ids = 0;
+
+    T * allocate(uint64_t chunk) {
+        assert(chunk < (THREAD_TABLE_MAX_THREADS >> THREAD_TABLE_CHUNK_BITS));
+
+        T * current = nullptr;
+        T * fresh = new T[chunk_size]();
+
+        if(!chunks[chunk].compare_exchange_strong(current, fresh, std::memory_order_acq_rel, std::memory_order_acquire)) {
+            delete[] fresh;
+            return current;
+        }
+
+        uint64_t n = n_ids.load(std::memory_order_relaxed);
+        while(n < (chunk + 1) * chunk_size &&
+              !n_ids.compare_exchange_weak(n, (chunk + 1) * chunk_size, std::memory_order_release))
+            ;
+
+        return fresh;
+    }
+
+public:
+    T & operator[](uint64_t tid) {
+        T * chunk = chunks[tid >> THREAD_TABLE_CHUNK_BITS].load(std::memory_order_acquire);
+
+        if(__builtin_expect(chunk == nullptr, 0))
+            chunk = allocate(tid >> THREAD_TABLE_CHUNK_BITS);
+
+        return chunk[tid & (chunk_size - 1)];
+    }
+
+    // Entry of a thread that already used the table, without the allocation branch (inlined analysis routines)
+    T & lookup(uint64_t tid) const {
+        return chunks[tid >> THREAD_TABLE_CHUNK_BITS].load(std::memory_order_relaxed)[tid & (chunk_size - 1)];
+    }
+
+    // Upper bound of the thread ids used so far, entries past the used ones are value initialized
+    uint64_t size() const {
+        return n_ids.load(std::memory_order_acquire);
+    }
+
+    // f(tid, entry) for the entries of the allocated chunks
+    template<typename F>
+    void for_each(F f) {
+        uint64_t n = size();
+
+        for(uint64_t c = 0; c < (n >> THREAD_TABLE_CHUNK_BITS); c++) {
+            T * chunk = chunks[c].load(std::memory_order_acquire);
+
+            if(chunk == nullptr)
+                continue;
+
+            for(uint64_t i = 0; i < chunk_size; i++)
+                f((c << THREAD_TABLE_CHUNK_BITS) + i, chunk[i]);
+        }
+    }
+};
+
+#endif
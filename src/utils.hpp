@@ -11,6 +11,7 @@
 #include <unistd.h>
 
 #include <set>
+#include <map>
 #include <string>
 #include <vector>
 #include <fstream>
@@ -21,6 +22,9 @@
 #include "pin.H"
 #include "trace.hpp"
 #include "logger.hpp"
+#include "pm_index.hpp"
+#include "cct.hpp"
+#include "thread_table.hpp"
 
 
 #define RECORD_OPERATIONS_LIMIT 10000000
@@ -28,7 +32,6 @@
 #define CACHE_LINE(A) (((A) / 64) * 64)
 
 
-static bool found_alloc = false;
 static const char *pm_mount;
 
 // Structure used when instrumenting mmap allocations
@@ -46,11 +49,14 @@ struct PMAllocation {
     std::string path;
     uint64_t flags;
     uint64_t prot;
-    bool unmapped = false;
 };
 
+// Live PM mappings, guarded by pm_index_mutex (lookups go through pm_index)
 std::vector<PMAllocation> allocs;
-int n_allocs = 0;
+
+// mmap of a PM file in flight, per thread
+static ThreadTable<PMAllocation> pending_allocs;
+static ThreadTable<bool> found_alloc;
 
 bool FDPointsToPM(int fd, char file_path[1000]) {
     char fd_path[32];
@@ -70,16 +76,18 @@ bool FDPointsToPM(int fd, char file_path[1000]) {
     return false;
 }
 
-VOID SysBefore(uint64_t ip, uint64_t num, uint64_t size, uint64_t flags,
+VOID SysBefore(THREADID tid, uint64_t ip, uint64_t num, uint64_t size, uint64_t flags,
                uint64_t fd, uint64_t prot, uint64_t address) {
 
     char file_path[1000];
     if(num == SYS_munmap) {
-        for(PMAllocation &alloc : allocs) {
-            if(alloc.start == address && alloc.size == size) {
-                alloc.unmapped = true;
-            }
-        }
+        pm_index.remove(address, address + size);
+
+        PIN_MutexLock(&pm_index_mutex);
+        std::erase_if(allocs, [=](const PMAllocation & alloc) {
+            return alloc.start >= address && alloc.end <= address + size;
+        });
+        PIN_MutexUnlock(&pm_index_mutex);
     }
 
     // If the mmap call is not creating a private mapping, that is, they use the
@@ -88,30 +96,37 @@ VOID SysBefore(uint64_t ip, uint64_t num, uint64_t size, uint64_t flags,
         (((flags & 0x01) == 0x01) || ((flags & 0x03) == 0x03)) &&
         FDPointsToPM(fd, file_path)) {
         LOG("size: " + std::to_string((uint64_t) size) + "\n");
-        allocs.emplace_back(size, file_path, flags, prot);
-        found_alloc = true;
+        pending_allocs[tid] = PMAllocation(size, file_path, flags, prot);
+        found_alloc[tid] = true;
     }
 }
 
-VOID SysAfter(uint64_t return_value) {
-    if (found_alloc == true) {
+VOID SysAfter(THREADID tid, uint64_t return_value) {
+    if (found_alloc[tid] == true) {
+        found_alloc[tid] = false;
 
         if(return_value == (uint64_t) (-1)) {
             LOG("failed\n");
-            allocs.pop_back();
-            found_alloc = false;
             return;
         }
 
-        allocs.back().set_start(return_value);
-        found_alloc = false;
+        PMAllocation & alloc = pending_allocs[tid];
+        alloc.set_start(return_value);
+
+        PIN_MutexLock(&pm_index_mutex);
+        allocs.push_back(alloc);
+        PIN_MutexUnlock(&pm_index_mutex);
+
+        pm_index.insert(alloc.start, alloc.end);
+
         LOG("start: " + std::to_string((uint64_t) return_value) + "\n");
     }
 }
 
 VOID SyscallEntry(THREADID thread, CONTEXT *ctxt, SYSCALL_STANDARD std,
                   VOID *v) {
-    SysBefore(PIN_GetContextReg(ctxt, REG_INST_PTR),
+    SysBefore(thread,
+              PIN_GetContextReg(ctxt, REG_INST_PTR),
               PIN_GetSyscallNumber(ctxt, std),
               PIN_GetSyscallArgument(ctxt, std, 1),
               PIN_GetSyscallArgument(ctxt, std, 3),
@@ -122,23 +137,14 @@ VOID SyscallEntry(THREADID thread, CONTEXT *ctxt, SYSCALL_STANDARD std,
 
 VOID SyscallExit(THREADID thread, CONTEXT *ctxt, SYSCALL_STANDARD std,
                  VOID *v) {
-    SysAfter(PIN_GetSyscallReturn(ctxt, std));
+    SysAfter(thread, PIN_GetSyscallReturn(ctxt, std));
 }
 
 // Function will return true if the write is operating on Pmem
 bool IsPMAddress(uint64_t address, uint32_t size, uint64_t tid) {
     bool res;
 COUNT_TIME_GENERIC(ispm_time, {
-    uint64_t range_end = address + size;
-    res = false;
-    for(const auto& allocation : allocs) {
-        if (allocation.unmapped == false &&
-            (address >= allocation.start) &&
-            ((range_end) <= (allocation.end))) {
-            res = true;
-            break;
-        }
-    }
+    res = pm_index.contains(tid, address, address + size);
 })
     return res;
 }
@@ -183,6 +189,27 @@ bool IsMovnt(int opcode) {
     return inst_is_movnt;
 }
 
+// REP string operations with an unconditional number of iterations
+bool IsRepString(int opcode) {
+    switch (opcode) {
+        case XED_ICLASS_REP_MOVSB:
+        case XED_ICLASS_REP_MOVSW:
+        case XED_ICLASS_REP_MOVSD:
+        case XED_ICLASS_REP_MOVSQ:
+        case XED_ICLASS_REP_STOSB:
+        case XED_ICLASS_REP_STOSW:
+        case XED_ICLASS_REP_STOSD:
+        case XED_ICLASS_REP_STOSQ:
+        case XED_ICLASS_REP_LODSB:
+        case XED_ICLASS_REP_LODSW:
+        case XED_ICLASS_REP_LODSD:
+        case XED_ICLASS_REP_LODSQ:
+            return true;
+        default:
+            return false;
+    }
+}
+
 // Check if instruction is a fence
 bool IsFence(int opcode) {
     bool inst_is_fence = false;
@@ -254,6 +281,34 @@ inline bool addr_colision(uint64_t a1, uint32_t s1, uint64_t a2, uint32_t s2) {
     return (a1 + s1) > a2 && (a2 + s2) > a1;
 }
 
+enum BacktraceMode {BT_SHADOW_STACK, BT_FRAME_POINTER, BT_PIN};
+
+std::map<std::string, enum BacktraceMode> backtraceModes = {
+    {"shadow", BT_SHADOW_STACK},
+    {"frame", BT_FRAME_POINTER},
+    {"pin", BT_PIN}
+};
+
+BacktraceMode backtrace_mode = BT_SHADOW_STACK;
+
+// Only the register based strategies need the analysis routines to get a CONTEXT
+inline bool BacktraceNeedsContext() {
+#ifdef NO_BACKTRACE
+    return false;
+#else
+    return backtrace_mode != BT_SHADOW_STACK;
+#endif
+}
+
+// Only the call/ret based strategy needs calls and returns to be instrumented
+inline bool BacktraceUsesShadowStack() {
+#ifdef NO_BACKTRACE
+    return false;
+#else
+    return backtrace_mode == BT_SHADOW_STACK;
+#endif
+}
+
 #ifdef NO_BACKTRACE
 typedef void* backtrace_t;
 
@@ -264,40 +319,39 @@ std::string GetBacktraceSymbols(backtrace_t trace) {
 size_t get_traces_size() {
     return 0;
 }
+
+inline backtrace_t canonical(backtrace_t trace) {
+    return trace;
+}
 #else
-typedef std::vector<void*>* backtrace_t;
+// Leaf of the calling context tree, its address is the accessing instruction
+typedef CCTNode* backtrace_t;
 
-std::string GetBacktraceSymbols(backtrace_t trace) {
-    return _GetBacktraceSymbols(trace->data(), trace->size());
-} 
+extern uint64_t backtrace_depth;
 
-struct BacktraceComparator {
-    bool operator() (const backtrace_t r1, const backtrace_t r2) {
-        if(r1->size() == r2->size())
-            return memcmp(r1->data(), r2->data(), r1->size() * sizeof(void *)) < 0;
+std::string GetBacktraceSymbols(backtrace_t trace) {
+    std::vector<void *> addresses;
 
-        return r1->size() < r2->size();
+    for(CCTNode * node = trace; node != nullptr && !node->is_root(); node = node->parent) {
+        if(addresses.size() == backtrace_depth)
+            break;
+        addresses.push_back(node->address);
     }
-};
-
 
-static std::set<backtrace_t, struct BacktraceComparator> backtraces;
+    return _GetBacktraceSymbols(addresses.data(), addresses.size());
+} 
 
 size_t get_traces_size() {
-    size_t s = 0;
-    for(const auto& it : backtraces) {
-        s += sizeof(void *) * it->capacity();
-    }
-    return s;
+    return cct_nodes;
 }
 
-int CustomBackTrace(const CONTEXT *ctxt, void ** addresses, uint64_t depth) {
+int CustomBackTrace(uint64_t ip, const CONTEXT *ctxt, void ** addresses, uint64_t depth) {
     if(depth==0)
         return 0;
 
     uint64_t i = 0;
 
-    addresses[i++] = (void *) PIN_GetContextReg(ctxt, REG_INST_PTR);
+    addresses[i++] = (void *) ip;
     if(!addresses[0])
         return 0;
 
@@ -321,50 +375,36 @@ int CustomBackTrace(const CONTEXT *ctxt, void ** addresses, uint64_t depth) {
     return i;
 } 
 
-extern PIN_MUTEX backtrace_mutex;
-
-backtrace_t GetBacktrace(const CONTEXT *ctxt, uint64_t depth, std::vector<void*> trace) {
-    
-
-    backtrace_t ret = nullptr;
-   
-    // Official PIN method used for getting backtraces (Expensive)
-
-    /*
-    void * addresses[depth];
-    int num_addresses;
-    PIN_LockClient();
-    num_addresses = PIN_Backtrace(ctxt, addresses, depth);
-    PIN_UnlockClient();
-
-    std::vector<void*> vec(addresses, addresses + num_addresses);
-    */
-    
-    // Custom Stack rewind mechanism (Cheap, loses part of the context)
-
-    /*
-    void * addresses[depth];
-    int num_addresses = CustomBackTrace(ctxt, addresses, depth);
-    std::vector<void*> vec(addresses, addresses + num_addresses);
-    */
-
-    // Custom call/ret based mechanim (Cheap, mostly correct and complete)
-    std::vector<void*> vec(trace.rbegin(), trace.rend());
-    vec.insert(vec.begin(), (void*) PIN_GetContextReg(ctxt, REG_INST_PTR));
-
-    PIN_MutexLock(&backtrace_mutex);
+/*
+    ctxt is only provided (see BacktraceNeedsContext) for the modes that
+    read registers, it is NULL for the shadow stack
+*/
+backtrace_t GetBacktrace(uint64_t ip, const CONTEXT *ctxt, uint64_t depth, CallingContext &context) {
+    switch(backtrace_mode) {
+        // Official PIN method used for getting backtraces (Expensive)
+        case BT_PIN: {
+            void * addresses[depth];
+            int num_addresses;
+            PIN_LockClient();
+            num_addresses = PIN_Backtrace(ctxt, addresses, depth);
+            PIN_UnlockClient();
+
+            return context.path(addresses, num_addresses);
+        }
 
-    auto vec_it = backtraces.find(&vec);
+        // Custom Stack rewind mechanism (Cheap, loses part of the context)
+        case BT_FRAME_POINTER: {
+            void * addresses[depth];
+            int num_addresses = CustomBackTrace(ip, ctxt, addresses, depth);
 
-    if(vec_it == backtraces.end()) {
-        vec_it = backtraces.insert(
-            new std::vector<void *>(vec)
-        ).first;
-    } 
+            return context.path(addresses, num_addresses);
+        }
 
-    ret = *vec_it;
-    PIN_MutexUnlock(&backtrace_mutex);
-    return ret;
+        // Custom call/ret based mechanim (Cheap, mostly correct and complete)
+        case BT_SHADOW_STACK:
+        default:
+            return context.current->child((void*) ip);
+    }
 }
 
 #endif
@@ -506,8 +546,15 @@ struct MutexConfig {
     std::vector<MutexFunctionInfo> adquire;
     std::vector<MutexFunctionInfo> release;
     std::vector<MutexFunctionInfo> try_adquire;
+    std::vector<MutexFunctionInfo> destroy;
     std::vector<std::string> adq_rel;
 
+    // Instrumentation filters (see filter.hpp)
+    std::vector<std::string> include_images;
+    std::vector<std::string> exclude_images;
+    std::vector<std::string> include_routines;
+    std::vector<std::string> exclude_routines;
+
     int mutex_id_size;
 
     MutexConfig(std::string filename) {
@@ -563,6 +610,8 @@ struct MutexConfig {
                         PopulateFunctions(try_adquire, value_node, &document);
                     } else if(!strcmp((char *)key_node->data.scalar.value, "release")) {
                         PopulateFunctions(release, value_node, &document);
+                    } else if(!strcmp((char *)key_node->data.scalar.value, "destroy")) {
+                        PopulateFunctions(destroy, value_node, &document);
                     } else {
                         parseError(filename, "invalid mapping", 0);
                     }
@@ -570,6 +619,14 @@ struct MutexConfig {
                 case YAML_SEQUENCE_NODE:
                     if(!strcmp((char *)key_node->data.scalar.value, "adq_rel")) {
                         ExtractFunctionList(adq_rel, value_node, &document);
+                    } else if(!strcmp((char *)key_node->data.scalar.value, "include_images")) {
+                        ExtractFunctionList(include_images, value_node, &document);
+                    } else if(!strcmp((char *)key_node->data.scalar.value, "exclude_images")) {
+                        ExtractFunctionList(exclude_images, value_node, &document);
+                    } else if(!strcmp((char *)key_node->data.scalar.value, "include_routines")) {
+                        ExtractFunctionList(include_routines, value_node, &document);
+                    } else if(!strcmp((char *)key_node->data.scalar.value, "exclude_routines")) {
+                        ExtractFunctionList(exclude_routines, value_node, &document);
                     } else {
                         parseError(filename, "invalid sequence", 0);
                     }
@@ -590,7 +647,7 @@ struct MutexConfig {
     void Print() const {
         std::cout << "mutex size: " << mutex_id_size << std::endl;
 
-        auto funcs = {adquire, release, try_adquire};
+        auto funcs = {adquire, release, try_adquire, destroy};
 
         for(const auto & func : funcs) {
             for(const MutexFunctionInfo& info : func) {
@@ -666,6 +723,29 @@ void InstrumentAdqRelRoutine(IMG img, const char * name, AFUNPTR beforePtr, AFUN
     }
 }
 
+// Calls ptr(tid, ctxt) both at the entry and at the exit of the routine, before any other analysis call
+void InstrumentContextRoutine(IMG img, const char * name, AFUNPTR ptr) {
+    RTN routine = RTN_FindByName(img, name);
+
+    if(RTN_Valid(routine)) {
+        RTN_Open(routine);
+
+        RTN_InsertCall(routine, IPOINT_BEFORE, ptr,
+                                IARG_CALL_ORDER, CALL_ORDER_FIRST,
+                                IARG_THREAD_ID,
+                                IARG_CONST_CONTEXT,
+                                IARG_END);
+
+        RTN_InsertCall(routine, IPOINT_AFTER, ptr,
+                                IARG_CALL_ORDER, CALL_ORDER_FIRST,
+                                IARG_THREAD_ID,
+                                IARG_CONST_CONTEXT,
+                                IARG_END);
+
+        RTN_Close(routine);
+    }
+}
+
 void InstrumentLockRoutine(IMG img, AFUNPTR beforePtr, const MutexFunctionInfo &info, AFUNPTR afterPtr = NULL) {
 
     RTN routine = RTN_FindByName(img, info.name.c_str());